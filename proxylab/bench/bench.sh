@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# bench.sh - Start bench/origin and the proxy on local ports, run loadgen
+#     against them and stop both again. Run it from proxylab, usually as
+#     "make bench".
+#
+#     ORIGIN_PORT, PROXY_PORT   ports to use (18280 and 18281)
+#     PROXY_OPTS                extra proxy options, e.g. "-e" or "-n 32"
+#     LOADGEN_OPTS              loadgen options (default "-t 8 -d 10 -S")
+#
+# In threaded mode a loadgen thread keeps its worker for at most a turn of
+# back-to-back requests, and gives it up early when other connections are
+# queued, so -t above the proxy's -n shows fair queueing, not starvation.
+
+ORIGIN_PORT=${ORIGIN_PORT:-18280}
+PROXY_PORT=${PROXY_PORT:-18281}
+LOADGEN_OPTS=${LOADGEN_OPTS:--t 8 -d 10 -S}
+
+./bench/origin "$ORIGIN_PORT" &
+origin_pid=$!
+./proxy $PROXY_OPTS "$PROXY_PORT" > /dev/null &
+proxy_pid=$!
+trap 'kill $origin_pid $proxy_pid 2> /dev/null' EXIT INT TERM
+
+# give both a moment to start listening
+sleep 1
+
+./bench/loadgen $LOADGEN_OPTS "localhost:$PROXY_PORT" "localhost:$ORIGIN_PORT"
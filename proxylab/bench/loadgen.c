@@ -0,0 +1,301 @@
+/*
+ * loadgen.c - Closed-loop load generator for the proxy. Each thread keeps
+ *     one keep-alive connection to the proxy and sends its next request as
+ *     soon as the previous response is in, for a fixed duration. Requests
+ *     are drawn from a mix of
+ *
+ *         hit    small objects from a hot set, cached after warm-up
+ *         miss   small objects with a fresh uri every time
+ *         large  objects above MAX_OBJECT_SIZE, always relayed
+ *
+ *     served by bench/origin, and the report gives req/s, throughput and
+ *     latency percentiles for all requests and for each kind.
+ *
+ *     usage: loadgen [-t threads] [-d secs] [-m hit:miss:large] [-k hot]
+ *                    [-s bytes] [-L bytes] [-S] <proxy host:port> <origin host:port>
+ */
+#include "csapp.h"
+#include "hist.h"
+
+#define LG_BUF (64 * 1024)
+
+enum { KIND_HIT, KIND_MISS, KIND_LARGE, KIND_ALL, NKINDS };
+static const char *kind_names[NKINDS] = { "hit", "miss", "large", "all" };
+
+/* One thread's results, merged by main() at the end */
+typedef struct {
+    pthread_t tid;
+    unsigned int seed;
+    long requests, errors, retries, bytes;
+    Hist hists[NKINDS];
+} LgThread;
+
+static char *proxy_host, *proxy_port;
+static char *origin;                /* host:port, as it appears in uris */
+static int mix[3] = { 80, 15, 5 };  /* percent of hit, miss and large */
+static int hot = 100;
+static long small_size = 8192, large_size = 1L << 20;
+static long end_us;
+static long miss_seq;               /* makes every miss uri unique */
+static long nonce;                  /* ... across runs, too */
+
+static long lg_now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * lg_fetch - Send one GET for uri on *fd, connecting first if *fd < 0, and
+ *     read the whole response. body_out, if given, receives up to size - 1
+ *     bytes of the body. A kept connection that turns out to be closed is
+ *     replaced once, counted in *retries so that connections the proxy
+ *     dropped still show. Returns the body length, or -1 on failure (with
+ *     *fd closed). *fd is also closed if the proxy will not keep it.
+ */
+static long lg_fetch(int *fd, rio_t *rio, char *uri, char *body_out, int size, long *retries) {
+    char line[MAXLINE], buf[LG_BUF];
+    long len = -1, got = 0;
+    int status = 0, keep = 1, reused = *fd >= 0, len_line;
+    ssize_t n;
+
+    while (1) {
+        if (*fd < 0) {
+            if ((*fd = open_clientfd(proxy_host, proxy_port)) < 0)
+                return -1;
+            rio_readinitb(rio, *fd);
+        }
+
+        len_line = snprintf(line, MAXLINE, "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", uri, origin);
+        if (rio_writen(*fd, line, len_line) == len_line && rio_readlineb(rio, line, MAXLINE) > 0)
+            break;
+
+        Close(*fd);
+        *fd = -1;
+        if (!reused)
+            return -1;
+        reused = 0;
+        (*retries)++;
+    }
+    if (sscanf(line, "HTTP/%*d.%*d %d", &status) != 1)
+        goto fail;
+
+    while (1) {
+        if (rio_readlineb(rio, line, MAXLINE) <= 0)
+            goto fail;
+        if (strcmp(line, "\r\n") == 0)
+            break;
+        if (strncasecmp(line, "Content-length:", 15) == 0)
+            len = atol(line + 15);
+        else if (strncasecmp(line, "Connection:", 11) == 0)
+            keep = strncasecmp(line + 11 + strspn(line + 11, " \t"), "close", 5) != 0;
+    }
+
+    // without a length the body runs to EOF
+    while (len < 0 || got < len) {
+        int want = (len < 0 || len - got > LG_BUF) ? LG_BUF : len - got;
+        if ((n = rio_readnb(rio, buf, want)) < 0)
+            goto fail;
+        if (n == 0)
+            break;
+        if (body_out != NULL && got < size - 1)
+            memcpy(body_out + got, buf, got + n < size - 1 ? n : size - 1 - got);
+        got += n;
+    }
+    if (body_out != NULL)
+        body_out[got < size - 1 ? got : size - 1] = '\0';
+
+    if (len < 0 || !keep) {
+        Close(*fd);
+        *fd = -1;
+    }
+    if (status != 200 || (len >= 0 && got != len))
+        return -1;
+    return got;
+
+fail:
+    Close(*fd);
+    *fd = -1;
+    return -1;
+}
+
+static void *lg_thread(void *vargp) {
+    LgThread *t = vargp;
+    char uri[MAXLINE];
+    rio_t rio;
+    long start, n;
+    int fd = -1, kind, pick;
+
+    while ((start = lg_now_us()) < end_us) {
+        pick = rand_r(&t->seed) % 100;
+        if (pick < mix[0]) {
+            kind = KIND_HIT;
+            snprintf(uri, MAXLINE, "http://%s/obj/%ld/hot-%d", origin, small_size, rand_r(&t->seed) % hot);
+        }
+        else if (pick < mix[0] + mix[1]) {
+            kind = KIND_MISS;
+            snprintf(uri, MAXLINE, "http://%s/obj/%ld/miss-%ld-%ld", origin, small_size, nonce,
+                    __atomic_add_fetch(&miss_seq, 1, __ATOMIC_RELAXED));
+        }
+        else {
+            kind = KIND_LARGE;
+            snprintf(uri, MAXLINE, "http://%s/obj/%ld/large-%d", origin, large_size, rand_r(&t->seed) % hot);
+        }
+
+        t->requests++;
+        if ((n = lg_fetch(&fd, &rio, uri, NULL, 0, &t->retries)) < 0) {
+            t->errors++;
+            usleep(1000);   /* do not spin on a proxy that is down */
+            continue;
+        }
+
+        t->bytes += n;
+        n = lg_now_us() - start;
+        hist_record(&t->hists[kind], n);
+        hist_record(&t->hists[KIND_ALL], n);
+    }
+
+    if (fd >= 0)
+        Close(fd);
+    return NULL;
+}
+
+/* Split "host:port" in place */
+static int lg_hostport(char *arg, char **host, char **port) {
+    char *colon = strrchr(arg, ':');
+
+    if (colon == NULL || colon == arg || colon[1] == '\0')
+        return -1;
+    *colon = '\0';
+    *host = arg;
+    *port = colon + 1;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int nthreads = 8, secs = 10, show_stats = 0;
+    char uri[MAXLINE], page[MAXBUF], *origin_host, *origin_port;
+    Hist *h, total[NKINDS];
+    LgThread *threads;
+    long requests = 0, errors = 0, retries = 0, bytes = 0, start;
+    long setup_retries = 0;     // outside the timed run, not reported
+    double elapsed;
+    rio_t rio;
+    int fd = -1, opt, i, j, k;
+
+    while ((opt = getopt(argc, argv, "d:k:L:m:s:St:")) != -1) {
+        switch (opt) {
+        case 'd':   // seconds to run
+            secs = atoi(optarg);
+            break;
+        case 'k':   // objects in the hot set
+            hot = atoi(optarg);
+            break;
+        case 'L':   // large object size
+            large_size = atol(optarg);
+            break;
+        case 'm':   // request mix, in percent
+            if (sscanf(optarg, "%d:%d:%d", &mix[0], &mix[1], &mix[2]) != 3 ||
+                    mix[0] < 0 || mix[1] < 0 || mix[2] < 0 || mix[0] + mix[1] + mix[2] != 100) {
+                fprintf(stderr, "The mix must be three percentages adding up to 100\n");
+                return 1;
+            }
+            break;
+        case 's':   // small object size
+            small_size = atol(optarg);
+            break;
+        case 'S':   // print the proxy's stats page afterwards
+            show_stats = 1;
+            break;
+        case 't':   // client threads, one connection each
+            nthreads = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t threads] [-d secs] [-m hit:miss:large] [-k hot] "
+                    "[-s bytes] [-L bytes] [-S] <proxy host:port> <origin host:port>\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2 || nthreads < 1 || secs < 1 || hot < 1 ||
+            lg_hostport(argv[optind], &proxy_host, &proxy_port) < 0) {
+        fprintf(stderr, "usage: %s [options] <proxy host:port> <origin host:port>\n", argv[0]);
+        return 1;
+    }
+    origin = strdup(argv[optind + 1]);
+    if (lg_hostport(argv[optind + 1], &origin_host, &origin_port) < 0) {
+        fprintf(stderr, "Bad origin address: %s\n", origin);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    nonce = (long)time(NULL) * 100000 + getpid() % 100000;
+
+    // warm-up: bring the hot set into the cache
+    for (i = 0; mix[0] > 0 && i < hot; i++) {
+        snprintf(uri, MAXLINE, "http://%s/obj/%ld/hot-%d", origin, small_size, i);
+        if (lg_fetch(&fd, &rio, uri, NULL, 0, &setup_retries) < 0) {
+            fprintf(stderr, "Warm-up request failed: %s\n", uri);
+            return 1;
+        }
+    }
+    if (fd >= 0)
+        Close(fd);
+
+    threads = Calloc(nthreads, sizeof(LgThread));
+    start = lg_now_us();
+    end_us = start + secs * 1000000L;
+    for (i = 0; i < nthreads; i++) {
+        threads[i].seed = nonce + i;
+        Pthread_create(&threads[i].tid, NULL, lg_thread, &threads[i]);
+    }
+
+    memset(total, 0, sizeof(total));
+    for (i = 0; i < nthreads; i++) {
+        Pthread_join(threads[i].tid, NULL);
+        requests += threads[i].requests;
+        errors += threads[i].errors;
+        retries += threads[i].retries;
+        bytes += threads[i].bytes;
+        for (k = 0; k < NKINDS; k++) {
+            h = &threads[i].hists[k];
+            for (j = 0; j < HIST_BUCKETS; j++)
+                total[k].buckets[j] += h->buckets[j];
+            total[k].count += h->count;
+            total[k].sum += h->sum;
+            if (h->max > total[k].max)
+                total[k].max = h->max;
+        }
+    }
+    elapsed = (lg_now_us() - start) / 1e6;
+
+    printf("%d threads, %.1f s, mix %d:%d:%d (hit:miss:large), %ld + %ld byte objects\n",
+            nthreads, elapsed, mix[0], mix[1], mix[2], small_size, large_size);
+    printf("requests %ld (%.1f req/s), errors %ld, retried on a dropped connection %ld, %.1f MB/s\n\n",
+            requests, (requests - errors) / elapsed, errors, retries, bytes / elapsed / (1 << 20));
+
+    printf("%-12s %8s %8s %8s %8s %8s %8s %8s\n",
+            "latency_us", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (k = 0; k < NKINDS; k++) {
+        h = &total[k];
+        if (h->count == 0)
+            continue;
+        printf("%-12s %8ld %8ld %8ld %8ld %8ld %8ld %8ld\n", kind_names[k], h->count, h->sum / h->count,
+                hist_percentile(h, 0.5), hist_percentile(h, 0.9), hist_percentile(h, 0.99),
+                hist_percentile(h, 0.999), h->max);
+    }
+
+    // the proxy's side of the story
+    if (show_stats) {
+        fd = -1;
+        if (lg_fetch(&fd, &rio, "http://proxy.local/stats", page, MAXBUF, &setup_retries) < 0)
+            printf("\nCould not fetch the proxy's stats page\n");
+        else
+            printf("\n%s", page);
+        if (fd >= 0)
+            Close(fd);
+    }
+
+    return errors > 0 ? 2 : 0;
+}
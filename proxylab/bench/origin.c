@@ -0,0 +1,133 @@
+/*
+ * origin.c - Tiny-style origin server for benchmarking the proxy. Instead
+ *     of files it serves synthetic objects, so runs need no fixtures:
+ *
+ *         GET /obj/<bytes>[/anything]
+ *
+ *     returns a 200 with a <bytes> long body (anything just makes the uri
+ *     unique). Connections are HTTP/1.1 keep-alive unless the client says
+ *     otherwise, one thread each.
+ *
+ *     usage: origin <port>
+ */
+#include "csapp.h"
+
+#define ORIGIN_MAX_OBJECT (64L << 20)
+#define ORIGIN_CHUNK (64 * 1024)
+
+static char body[ORIGIN_CHUNK];     /* every body is this pattern, repeated */
+
+/* Answer with an empty body; returns -1 if the client went away */
+static int origin_error(int fd, int status, char *reason) {
+    char buf[MAXLINE];
+    int len;
+
+    len = snprintf(buf, MAXLINE, "HTTP/1.1 %d %s\r\nContent-length: 0\r\nConnection: close\r\n\r\n",
+            status, reason);
+    return rio_writen(fd, buf, len) == len ? 0 : -1;
+}
+
+/* Head and body go out in one writev() so Nagle never holds the body back */
+static int origin_object(int fd, long size, int keep) {
+    char head[MAXLINE];
+    struct iovec iov[2];
+    long left;
+    int n;
+
+    iov[0].iov_base = head;
+    iov[0].iov_len = snprintf(head, MAXLINE, "HTTP/1.1 200 OK\r\nContent-type: application/octet-stream\r\n"
+            "Content-length: %ld\r\n%s\r\n", size, keep ? "" : "Connection: close\r\n");
+    for (left = size; iov[0].iov_len > 0 || left > 0; left -= n) {
+        n = left < ORIGIN_CHUNK ? left : ORIGIN_CHUNK;
+        iov[1].iov_base = body;
+        iov[1].iov_len = n;
+        if (rio_writev(fd, iov, 2) < 0)
+            return -1;
+        iov[0].iov_len = 0;
+    }
+    return 0;
+}
+
+/*
+ * origin_serve - Answer requests on one connection until the client closes
+ *     it or asks to.
+ */
+static void origin_serve(int fd) {
+    char line[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    rio_t rio;
+    long size;
+    int keep, rc;
+    char *end;
+
+    rio_readinitb(&rio, fd);
+    while (1) {
+        if (rio_readlineb(&rio, line, MAXLINE) <= 0)
+            return;
+        if (sscanf(line, "%s %s %s", method, uri, version) != 3)
+            return;
+
+        // HTTP/1.1 persists by default, HTTP/1.0 must ask
+        keep = strcmp(version, "HTTP/1.1") == 0;
+        while (1) {
+            if (rio_readlineb(&rio, line, MAXLINE) <= 0)
+                return;
+            if (strcmp(line, "\r\n") == 0)
+                break;
+            if (strncasecmp(line, "Connection:", 11) == 0)
+                keep = strncasecmp(line + 11 + strspn(line + 11, " \t"), "close", 5) != 0;
+        }
+
+        if (strcmp(method, "GET") != 0) {
+            rc = origin_error(fd, 501, "Not Implemented");
+            keep = 0;
+        }
+        else if (strncmp(uri, "/obj/", 5) != 0 || (size = strtol(uri + 5, &end, 10)) < 0 ||
+                (*end != '\0' && *end != '/') || size > ORIGIN_MAX_OBJECT) {
+            rc = origin_error(fd, 404, "Not Found");
+            keep = 0;
+        }
+        else {
+            rc = origin_object(fd, size, keep);
+        }
+
+        if (rc < 0 || !keep)
+            return;
+    }
+}
+
+static void *origin_thread(void *vargp) {
+    int fd = *(int *)vargp;
+
+    Free(vargp);
+    Pthread_detach(pthread_self());
+    origin_serve(fd);
+    Close(fd);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    pthread_t tid;
+    int listenfd, i, *fdp;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+        exit(1);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    for (i = 0; i < ORIGIN_CHUNK; i++)
+        body[i] = 'a' + i % 26;
+
+    listenfd = Open_listenfd(argv[1]);
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        fdp = Malloc(sizeof(int));
+        if ((*fdp = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0) {
+            Free(fdp);
+            continue;
+        }
+        Pthread_create(&tid, NULL, origin_thread, fdp);
+    }
+}
@@ -1,101 +1,893 @@
-#include <assert.h>
+#include <limits.h>
 #include "csapp.h"
 #include "cache.h"
+#include "stats.h"
 
-void cache_init(CacheList *list) {
-    list->free_space = MAX_CACHE_SIZE;
-    list->head = list->tail = NULL;
+/* FNV-1a over the normalized uri */
+unsigned int cache_hash(const char *uri) {
+    unsigned int h = 2166136261u;
+
+    while (*uri != '\0') {
+        h ^= (unsigned char)*uri++;
+        h *= 16777619u;
+    }
+    return h;
 }
 
-void cache_renew(CacheList *list, CacheNode *node) {
-    pthread_mutex_lock(&mutex);
-    printf(" $begin cache_renew\n");
+/* Bucket index uses the low bits of the hash, shard index the next ones */
+#define CACHE_BUCKET(hash) ((hash) & (CACHE_BUCKETS - 1))
+#define CACHE_SHARD(cache, hash) \
+    (&(cache)->shards[((hash) / CACHE_BUCKETS) & (CACHE_SHARDS - 1)])
+
+static const char *policy_names[CACHE_NPOLICIES] = { "lru", "clock", "s3fifo", "lfu" };
 
-    if (list->tail != node) {
-        if (node->prev != NULL)
-            node->prev->next = node->next;
+/* The policy called name, or -1 */
+int cache_policy(const char *name) {
+    int i;
+
+    for (i = 0; i < CACHE_NPOLICIES; i++) {
+        if (strcasecmp(name, policy_names[i]) == 0)
+            return i;
+    }
+    return -1;
+}
 
-        if (node->next != NULL)
-            node->next->prev = node->prev;
+const char *cache_policy_name(CachePolicy policy) {
+    return policy_names[policy];
+}
+
+void cache_init(Cache *cache, long capacity, char *store_dir, CachePolicy policy) {
+    int i;
+
+    cache->policy = policy;
+    cache->admission = 0;
+    cache->capacity = capacity;
+    cache->free_space = capacity;
+    cache->store_dir = store_dir;
+    cache->max_object = MAX_OBJECT_SIZE;
+    if (store_dir != NULL && capacity / CACHE_STORE_OBJECT > MAX_OBJECT_SIZE)
+        cache->max_object = capacity / CACHE_STORE_OBJECT > INT_MAX ? INT_MAX : capacity / CACHE_STORE_OBJECT;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        CacheList *list = &cache->shards[i];
+        pthread_mutex_init(&list->lock, NULL);
+        memset(list->queues, 0, sizeof(list->queues));
+        memset(list->buckets, 0, sizeof(list->buckets));
+        memset(list->ghosts, 0, sizeof(list->ghosts));
+        memset(&list->sketch, 0, sizeof(list->sketch));
+        list->flights = NULL;
+        list->ghost_pos = 0;
+        list->age = 0;
+    }
+}
 
-        list->tail->next = node;
-        node->prev = list->tail;
-        list->tail = node;
+/* Append node to the tail of a queue; the caller holds the shard lock */
+static void queue_push(CacheQueue *q, CacheNode *node) {
+    node->next = NULL;
+    node->prev = q->tail;
+    if (q->tail != NULL)
+        q->tail->next = node;
+    else
+        q->head = node;
+    q->tail = node;
+    q->bytes += node->content_len;
+}
+
+static void queue_remove(CacheQueue *q, CacheNode *node) {
+    if (node->prev != NULL)
+        node->prev->next = node->next;
+    else
+        q->head = node->next;
+    if (node->next != NULL)
+        node->next->prev = node->prev;
+    else
+        q->tail = node->prev;
+    q->bytes -= node->content_len;
+}
+
+/* Send node to the back of its queue */
+static void queue_requeue(CacheQueue *q, CacheNode *node) {
+    if (q->tail != node) {
+        queue_remove(q, node);
+        queue_push(q, node);
+    }
+}
+
+/* S3-FIFO ghosts: was hash evicted from probation lately? Forgets it if so */
+static int ghost_take(CacheList *list, unsigned int hash) {
+    int i;
+
+    for (i = 0; i < CACHE_S3_GHOSTS; i++) {
+        if (list->ghosts[i] == hash) {
+            list->ghosts[i] = 0;
+            return 1;
+        }
     }
+    return 0;
+}
 
-    printf(" $end cache_renew\n");
-    pthread_mutex_unlock(&mutex);
+static void ghost_add(CacheList *list, unsigned int hash) {
+    list->ghosts[list->ghost_pos] = hash;
+    list->ghost_pos = (list->ghost_pos + 1) % CACHE_S3_GHOSTS;
 }
 
-void cache_append(CacheList *list, CacheNode *node) {
-    pthread_mutex_lock(&mutex);
+/* Link node into its shard; the caller holds list->lock */
+static void cache_link(Cache *cache, CacheList *list, CacheNode *node) {
+    CacheNode **bucket = &list->buckets[CACHE_BUCKET(node->hash)];
+    node->hnext = *bucket;
+    *bucket = node;
 
-    list->free_space -= node->content_len;
+    // S3-FIFO puts newcomers on probation unless they failed it recently
+    node->queue = CACHE_MAIN;
+    if (cache->policy == CACHE_S3FIFO && !ghost_take(list, node->hash))
+        node->queue = CACHE_SMALL;
+    node->freq = 0;
+    node->prio = list->age + 1;
+    queue_push(&list->queues[node->queue], node);
+}
 
-    if (list->tail == NULL) {
-        list->head = list->tail = node;
-    } else {
-        node->prev = list->tail;
-        list->tail->next = node;
-        list->tail = node;
+/* Record a hit on node; the caller holds list->lock */
+static void cache_touch(Cache *cache, CacheList *list, CacheNode *node) {
+    switch (cache->policy) {
+    case CACHE_LRU:
+        queue_requeue(&list->queues[node->queue], node);
+        break;
+    case CACHE_CLOCK:
+        node->freq = 1;
+        break;
+    case CACHE_S3FIFO:
+        if (node->freq < 3)
+            node->freq++;
+        break;
+    case CACHE_LFU:
+        node->freq++;
+        node->prio = list->age + node->freq + 1;
+        break;
+    default:
+        break;
     }
+}
+
+/*
+ * cache_victim - Pick the node the policy evicts next, or NULL if the
+ *     shard is empty. CLOCK and S3-FIFO do their deferred bookkeeping here,
+ *     moving nodes with hits on instead of evicting them. The caller holds
+ *     list->lock.
+ */
+static CacheNode *cache_victim(Cache *cache, CacheList *list) {
+    CacheQueue *main_q = &list->queues[CACHE_MAIN], *small_q = &list->queues[CACHE_SMALL];
+    CacheNode *node, *min;
+
+    switch (cache->policy) {
+    case CACHE_CLOCK:
+        // a set bit buys one more round, cleared
+        while ((node = main_q->head) != NULL && node->freq) {
+            node->freq = 0;
+            queue_requeue(main_q, node);
+        }
+        return node;
 
-    pthread_mutex_unlock(&mutex);
+    case CACHE_S3FIFO:
+        while (1) {
+            if (small_q->head != NULL && (main_q->head == NULL ||
+                    small_q->bytes * 100 >= (small_q->bytes + main_q->bytes) * CACHE_S3_SMALL)) {
+                // probation is over: reused nodes move to main, the rest leave
+                node = small_q->head;
+                if (node->freq <= 1)
+                    return node;
+                queue_remove(small_q, node);
+                node->queue = CACHE_MAIN;
+                node->freq = 0;
+                queue_push(main_q, node);
+            }
+            else if ((node = main_q->head) != NULL) {
+                if (node->freq == 0)
+                    return node;
+                node->freq--;
+                queue_requeue(main_q, node);
+            }
+            else {
+                return NULL;
+            }
+        }
+
+    case CACHE_LFU:
+        for (min = node = main_q->head; node != NULL; node = node->next) {
+            if (node->prio < min->prio)
+                min = node;
+        }
+        if (min != NULL)
+            list->age = min->prio;
+        return min;
+
+    default:
+        return main_q->head;
+    }
 }
 
-void cache_evict(CacheList *list) {
-    pthread_mutex_lock(&mutex);
+/*
+ * cache_peek_victim - The node cache_victim() would most likely pick, left
+ *     as it is: no bits cleared, nodes moved or age advanced. For S3-FIFO
+ *     it follows probation the way eviction would, then takes the first
+ *     main node without credit, or failing that the one with the least.
+ *     The caller holds list->lock.
+ */
+static CacheNode *cache_peek_victim(Cache *cache, CacheList *list) {
+    CacheQueue *main_q = &list->queues[CACHE_MAIN], *small_q = &list->queues[CACHE_SMALL];
+    CacheNode *node, *min;
+    long small_bytes, total_bytes;
 
-    assert(list->head != NULL);
+    switch (cache->policy) {
+    case CACHE_CLOCK:
+        // after a full round of clearing bits the head goes
+        for (node = main_q->head; node != NULL; node = node->next) {
+            if (!node->freq)
+                return node;
+        }
+        return main_q->head;
 
-    list->free_space += list->head->content_len;
+    case CACHE_S3FIFO:
+        small_bytes = small_q->bytes;
+        total_bytes = small_q->bytes + main_q->bytes;
+        for (node = small_q->head; node != NULL; node = node->next) {
+            if (main_q->head != NULL && small_bytes * 100 < total_bytes * CACHE_S3_SMALL)
+                break;
+            if (node->freq <= 1)
+                return node;
+            small_bytes -= node->content_len;   /* would move to main */
+        }
+        for (min = node = main_q->head; node != NULL; node = node->next) {
+            if (node->freq == 0)
+                return node;
+            if (node->freq < min->freq)
+                min = node;
+        }
+        return min != NULL ? min : small_q->head;
 
-    Free(list->head->uri);
-    Free(list->head->content_type);
-    Free(list->head->content);
+    case CACHE_LFU:
+        for (min = node = main_q->head; node != NULL; node = node->next) {
+            if (node->prio < min->prio)
+                min = node;
+        }
+        return min;
 
-    if (list->head == list->tail) {
-        Free(list->head);
-        list->head = list->tail = NULL;
+    default:
+        return main_q->head;
     }
-    else {
-        Free(list->head);
-        list->head = list->head->next;
+}
+
+/*
+ * Nodes are reference counted: the cache holds one reference while a node
+ * is linked, and cache_search() hands out another that the reader drops
+ * with cache_release() once it has finished sending. Whoever drops the
+ * last reference frees the node, so eviction never pulls content out from
+ * under a reader and readers never need the shard lock while sending.
+ */
+void cache_release(CacheNode *node) {
+    if (__atomic_sub_fetch(&node->refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    Free(node->uri);
+    Free(node->header);
+    if (node->etag != NULL)
+        Free(node->etag);
+    if (node->last_modified != NULL)
+        Free(node->last_modified);
+    if (node->fd >= 0)
+        close(node->fd);
+    else
+        Free(node->content);
+    Free(node);
+}
+
+/* Can node be served without asking the server? */
+int cache_fresh(CacheNode *node) {
+    return time(NULL) < __atomic_load_n(&node->expires, __ATOMIC_RELAXED);
+}
+
+/* Seconds since the server made node's response, for its Age header */
+long cache_age(CacheNode *node) {
+    return __atomic_load_n(&node->initial_age, __ATOMIC_RELAXED) +
+        time(NULL) - __atomic_load_n(&node->stored, __ATOMIC_RELAXED);
+}
+
+/*
+ * cache_refresh - Give a pinned node the lifetime and age of the 304 that
+ *     just revalidated it. Its body, headers and validators stay as they
+ *     are.
+ */
+void cache_refresh(CacheNode *node, Freshness *fresh) {
+    __atomic_store_n(&node->expires, fresh->expires, __ATOMIC_RELAXED);
+    __atomic_store_n(&node->stored, fresh->received, __ATOMIC_RELAXED);
+    __atomic_store_n(&node->initial_age, fresh->age, __ATOMIC_RELAXED);
+    __atomic_store_n(&node->must_revalidate, fresh->must_revalidate, __ATOMIC_RELAXED);
+}
+
+/*
+ * cache_store_open - A new unlinked file under the cache's store_dir for a
+ *     body to be written into, or -1 if there is no file store or it is
+ *     unusable.
+ */
+int cache_store_open(Cache *cache) {
+    char path[MAXLINE];
+    int fd;
+
+    if (cache->store_dir == NULL)
+        return -1;
+    snprintf(path, MAXLINE, "%s/proxy-cache-XXXXXX", cache->store_dir);
+    if ((fd = mkstemp(path)) < 0)
+        return -1;
+    unlink(path);
+    return fd;
+}
+
+/*
+ * cache_spill - Copy content into the file store so it can be sent with
+ *     sendfile(). Returns the descriptor, or -1 if the content has to stay
+ *     on the heap.
+ */
+static int cache_spill(Cache *cache, char *content, int content_len) {
+    int fd;
+
+    if ((fd = cache_store_open(cache)) < 0)
+        return -1;
+    if (rio_writen(fd, content, content_len) != content_len) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Take node out of its shard's index and queue; the caller holds list->lock */
+static void cache_unlink(CacheList *list, CacheNode *node) {
+    CacheNode **link = &list->buckets[CACHE_BUCKET(node->hash)];
+    while (*link != node)
+        link = &(*link)->hnext;
+    *link = node->hnext;
+
+    queue_remove(&list->queues[node->queue], node);
+}
+
+/* The node for uri, or NULL; the caller holds list->lock */
+static CacheNode *cache_find(CacheList *list, char *uri, unsigned int hash) {
+    CacheNode *cur;
+
+    for (cur = list->buckets[CACHE_BUCKET(hash)]; cur != NULL; cur = cur->hnext) {
+        if (cur->hash == hash && strcmp(cur->uri, uri) == 0)
+            return cur;
+    }
+    return NULL;
+}
+
+/*
+ * cache_evict - Unlink the policy's victim in one shard, return its size
+ *     to the shared budget and drop the cache's reference to it. Returns 0
+ *     if the shard was empty.
+ */
+int cache_evict(Cache *cache, CacheList *list) {
+    CacheNode *victim;
+
+    pthread_mutex_lock(&list->lock);
+
+    if ((victim = cache_victim(cache, list)) == NULL) {
+        pthread_mutex_unlock(&list->lock);
+        return 0;
     }
+    cache_unlink(list, victim);
+    if (victim->queue == CACHE_SMALL)
+        ghost_add(list, victim->hash);
 
-    pthread_mutex_unlock(&mutex);
+    pthread_mutex_unlock(&list->lock);
+
+    __atomic_add_fetch(&cache->free_space, victim->content_len, __ATOMIC_RELAXED);
+    cache_release(victim);
+    stats_count(STAT_EVICTIONS, 1);
+    return 1;
 }
 
-void cache_add(CacheList *list, char *uri, int content_len, char *content_type, char *content) {
+/*
+ * cache_admit - Should an object of content_len bytes get in? Always while
+ *     it fits; once evictions are needed, only if the sketch has seen it
+ *     more often than the shard's next victim, times how many objects of
+ *     the victim's size it would displace. The victim is only peeked at,
+ *     so rejected objects do not age the policy's state; the eviction that
+ *     follows an admission picks its own.
+ */
+static int cache_admit(Cache *cache, CacheList *list, unsigned int hash, int content_len) {
+    CacheNode *victim;
+    int admit = 1, displaced;
+
+    if (__atomic_load_n(&cache->free_space, __ATOMIC_RELAXED) >= content_len)
+        return 1;
+
+    pthread_mutex_lock(&list->lock);
+    if ((victim = cache_peek_victim(cache, list)) != NULL) {
+        displaced = victim->content_len > 0 ? (content_len + victim->content_len - 1) / victim->content_len : 1;
+        if (displaced < 1)
+            displaced = 1;
+        admit = sketch_estimate(&list->sketch, hash) > sketch_estimate(&list->sketch, victim->hash) * displaced;
+    }
+    pthread_mutex_unlock(&list->lock);
+    return admit;
+}
+
+/*
+ * cache_node - A new unlinked node holding the cache's reference. Its body
+ *     is the store file fd if that is not -1, else content, moved to the
+ *     file store if there is one. Never stale and without validators or
+ *     header until the caller says otherwise.
+ */
+static CacheNode *cache_node(Cache *cache, char *uri, unsigned int hash, int content_len, char *content, int fd) {
     CacheNode *node = Malloc(sizeof(CacheNode));
 
     node->uri = strdup(uri);
+    node->hash = hash;
     node->content_len = content_len;
-    node->content_type = strdup(content_type);
-    node->content = strdup(content);
-    node->prev = NULL;
-    node->next = NULL;
+    node->content = content;
+    node->fd = fd;
+    if (fd < 0 && (node->fd = cache_spill(cache, content, content_len)) >= 0) {
+        Free(content);
+        node->content = NULL;
+    }
+    node->header = NULL;
+    node->header_len = 0;
+    node->hnext = NULL;
+    node->refcnt = 1;
+    node->expires = LONG_MAX;
+    node->stored = time(NULL);
+    node->initial_age = 0;
+    node->must_revalidate = 0;
+    node->etag = node->last_modified = NULL;
+    return node;
+}
+
+/*
+ * cache_insert - Reserve space for node, evicting as needed, and link it
+ *     in place of any older copy of the same uri.
+ */
+static void cache_insert(Cache *cache, CacheNode *node) {
+    CacheList *list = CACHE_SHARD(cache, node->hash);
+    int i, start = list - cache->shards, evicted;
+    CacheNode *old;
 
-    while (list->free_space < content_len) {
-        cache_evict(list);
+    // reserve space, evicting from our own shard first
+    __atomic_sub_fetch(&cache->free_space, node->content_len, __ATOMIC_RELAXED);
+    for (i = 0, evicted = 0; __atomic_load_n(&cache->free_space, __ATOMIC_RELAXED) < 0; ) {
+        if (cache_evict(cache, &cache->shards[(start + i) % CACHE_SHARDS])) {
+            evicted = 1;
+            continue;
+        }
+
+        // shard empty, move on; give up after a full pass that freed nothing
+        if (++i % CACHE_SHARDS == 0) {
+            if (!evicted)
+                break;
+            evicted = 0;
+        }
     }
 
-    cache_append(list, node);
+    pthread_mutex_lock(&list->lock);
+    if ((old = cache_find(list, node->uri, node->hash)) != NULL)
+        cache_unlink(list, old);
+    cache_link(cache, list, node);
+    pthread_mutex_unlock(&list->lock);
+    stats_count(STAT_INSERTS, 1);
+
+    if (old != NULL) {
+        __atomic_add_fetch(&cache->free_space, old->content_len, __ATOMIC_RELAXED);
+        cache_release(old);
+    }
 }
 
-CacheNode *cache_search(CacheList *list, char *uri) {
-    pthread_mutex_lock(&mutex);
+/* Response headers that only concern one connection, or that hits write themselves */
+static const char *cache_skipped[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate",
+    "TE", "Trailer", "Transfer-Encoding", "Upgrade", "Content-length", "Age"
+};
 
-    CacheNode *cur = list->head;
-    while (cur != NULL) {
-        if (strcmp(cur->uri, uri) == 0) {
-            pthread_mutex_unlock(&mutex);
-            return cur;
+static int cache_skip(HttpHeader *h, const char *buf) {
+    int i;
+
+    for (i = 0; i < sizeof(cache_skipped) / sizeof(cache_skipped[0]); i++) {
+        if (http_slice_is(buf, h->name, cache_skipped[i]))
+            return 1;
+    }
+    return 0;
+}
+
+/*
+ * cache_header - The header block to store with a 200 response parsed out
+ *     of buf: an HTTP/1.0 status line and the server's end-to-end headers,
+ *     as they came. Returns it NUL-terminated, for cache_add().
+ */
+char *cache_header(HttpHead *head, const char *buf) {
+    static const char status[] = "HTTP/1.0 200 OK\r\n";
+    HttpHeader *h;
+    char *header;
+    int i, len = sizeof(status), line;
+
+    for (i = 0; i < head->nheaders; i++) {
+        h = &head->headers[i];
+        len += h->value.off + h->value.len - h->name.off + 2;
+    }
+
+    header = Malloc(len);
+    strcpy(header, status);
+    for (i = 0, len = strlen(status); i < head->nheaders; i++) {
+        h = &head->headers[i];
+        if (cache_skip(h, buf))
+            continue;
+        line = h->value.off + h->value.len - h->name.off;
+        memcpy(header + len, buf + h->name.off, line);
+        memcpy(header + len + line, "\r\n", 2);
+        len += line + 2;
+    }
+    header[len] = '\0';
+    return header;
+}
+
+/*
+ * cache_add_node - Insert an object whose body is content, or the store
+ *     file fd if content is NULL. Shared by cache_add() and
+ *     cache_add_file().
+ */
+static int cache_add_node(Cache *cache, char *uri, int content_len, char *header,
+                          char *content, int fd, Freshness *fresh) {
+    unsigned int hash = cache_hash(uri);
+    CacheNode *node;
+    int len;
+
+    if (cache->admission && !cache_admit(cache, CACHE_SHARD(cache, hash), hash, content_len)) {
+        if (header != NULL)
+            Free(header);
+        if (content != NULL)
+            Free(content);
+        else
+            close(fd);
+        stats_count(STAT_REJECTED, 1);
+        return 0;
+    }
+
+    node = cache_node(cache, uri, hash, content_len, content, content != NULL ? -1 : fd);
+    if (fresh != NULL) {
+        node->expires = fresh->expires;
+        node->stored = fresh->received;
+        node->initial_age = fresh->age;
+        node->must_revalidate = fresh->must_revalidate;
+        if (fresh->etag[0] != '\0')
+            node->etag = strdup(fresh->etag);
+        if (fresh->last_modified[0] != '\0')
+            node->last_modified = strdup(fresh->last_modified);
+    }
+
+    // hits send this as is, followed by Age, their own Connection line and CRLF
+    if (header == NULL)
+        header = strdup("HTTP/1.0 200 OK\r\n");
+    len = strlen(header);
+    node->header = Realloc(header, len + 32);
+    node->header_len = len + sprintf(node->header + len, "Content-length: %d\r\n", content_len);
+
+    cache_insert(cache, node);
+    return 1;
+}
+
+/*
+ * cache_add - Insert an object, evicting as needed. An older copy of the
+ *     same uri, say from a fetch that raced this one, is replaced. header
+ *     comes from cache_header(), or is NULL for a bare status line. With no
+ *     fresh, the object never goes stale. Returns 0 if admission turned the
+ *     object away, freeing header and content, or 1.
+ */
+int cache_add(Cache *cache, char *uri, int content_len, char *header, char *content, Freshness *fresh) {
+    return cache_add_node(cache, uri, content_len, header, content, -1, fresh);
+}
+
+/*
+ * cache_add_file - cache_add() for a body already written to a file from
+ *     cache_store_open(), content_len bytes from its start. The file is
+ *     closed if admission turns the object away.
+ */
+int cache_add_file(Cache *cache, char *uri, int content_len, char *header, int fd, Freshness *fresh) {
+    return cache_add_node(cache, uri, content_len, header, NULL, fd, fresh);
+}
+
+/*
+ * cache_search - Count a lookup of uri and, on a hit, record it and return
+ *     it pinned. The caller must cache_release() the node when done.
+ *     Returns NULL on a miss.
+ */
+CacheNode *cache_search(Cache *cache, char *uri) {
+    unsigned int hash = cache_hash(uri);
+    CacheList *list = CACHE_SHARD(cache, hash);
+    CacheNode *cur;
+
+    pthread_mutex_lock(&list->lock);
+    sketch_add(&list->sketch, hash);
+
+    if ((cur = cache_find(list, uri, hash)) != NULL) {
+        __atomic_add_fetch(&cur->refcnt, 1, __ATOMIC_RELAXED);
+        cache_touch(cache, list, cur);
+    }
+
+    pthread_mutex_unlock(&list->lock);
+    return cur;
+}
+
+/*
+ * cache_search_flight - cache_search() that coalesces misses. The first
+ *     thread to miss on uri becomes its leader (*leader = 1): it fetches
+ *     the object and must call cache_land() once the object is cached or
+ *     known not to be. Others that miss meanwhile wait for that, at most
+ *     CACHE_FLIGHT_WAIT seconds (*waited = 1), and return the cached node,
+ *     or NULL to fetch the object themselves without leading.
+ */
+CacheNode *cache_search_flight(Cache *cache, char *uri, int *leader, int *waited) {
+    unsigned int hash = cache_hash(uri);
+    CacheList *list = CACHE_SHARD(cache, hash);
+    CacheFlight *flight;
+    struct timespec deadline;
+    CacheNode *cur;
+
+    *leader = *waited = 0;
+    pthread_mutex_lock(&list->lock);
+    sketch_add(&list->sketch, hash);
+
+    if ((cur = cache_find(list, uri, hash)) == NULL) {
+        for (flight = list->flights; flight != NULL; flight = flight->next) {
+            if (flight->hash == hash && strcmp(flight->uri, uri) == 0)
+                break;
+        }
+
+        if (flight == NULL) {
+            flight = Calloc(1, sizeof(CacheFlight));
+            flight->uri = strdup(uri);
+            flight->hash = hash;
+            pthread_cond_init(&flight->done, NULL);
+            flight->next = list->flights;
+            list->flights = flight;
+            *leader = 1;
+            pthread_mutex_unlock(&list->lock);
+            return NULL;
         }
 
-        cur = cur->next;
+        // follow the leader
+        *waited = 1;
+        flight->waiters++;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CACHE_FLIGHT_WAIT;
+        while (!flight->landed && pthread_cond_timedwait(&flight->done, &list->lock, &deadline) != ETIMEDOUT)
+            ;
+
+        // the leader unlinked a landed flight, the last waiter frees it
+        if (--flight->waiters == 0 && flight->landed) {
+            pthread_cond_destroy(&flight->done);
+            Free(flight->uri);
+            Free(flight);
+        }
+        cur = cache_find(list, uri, hash);
     }
 
-    pthread_mutex_unlock(&mutex);
-    return NULL;
-}
\ No newline at end of file
+    if (cur != NULL) {
+        __atomic_add_fetch(&cur->refcnt, 1, __ATOMIC_RELAXED);
+        cache_touch(cache, list, cur);
+    }
+
+    pthread_mutex_unlock(&list->lock);
+    return cur;
+}
+
+/* End the leader's flight for uri and wake everyone waiting on it */
+void cache_land(Cache *cache, char *uri) {
+    unsigned int hash = cache_hash(uri);
+    CacheList *list = CACHE_SHARD(cache, hash);
+    CacheFlight *flight, **link;
+
+    pthread_mutex_lock(&list->lock);
+
+    for (link = &list->flights; (flight = *link) != NULL; link = &flight->next) {
+        if (flight->hash == hash && strcmp(flight->uri, uri) == 0)
+            break;
+    }
+    if (flight != NULL) {
+        *link = flight->next;
+        flight->landed = 1;
+        if (flight->waiters > 0) {
+            pthread_cond_broadcast(&flight->done);
+        }
+        else {
+            pthread_cond_destroy(&flight->done);
+            Free(flight->uri);
+            Free(flight);
+        }
+    }
+
+    pthread_mutex_unlock(&list->lock);
+}
+
+/*
+ * Snapshot file: CACHE_SNAP_MAGIC, then one record per entry, coldest
+ * first within each shard so that loading it back in order rebuilds the
+ * queues much as they were. A record is a CacheSnapRecord followed by the
+ * uri, stored header, ETag, Last-Modified and body, none of them
+ * terminated. Records are written in host byte order, for the same
+ * machine to read back.
+ */
+#define CACHE_SNAP_MAGIC "PXCACHE2"
+
+typedef struct {
+    long expires;
+    long stored, initial_age;
+    int must_revalidate;
+    int uri_len, header_len, etag_len, last_modified_len, content_len;
+} CacheSnapRecord;
+
+/* Append node's record to fp; returns 0, or -1 on a write error */
+static int cache_save_node(FILE *fp, CacheNode *node) {
+    CacheSnapRecord rec;
+    char buf[MAXBUF];
+    long offset;
+    ssize_t n;
+
+    rec.expires = __atomic_load_n(&node->expires, __ATOMIC_RELAXED);
+    rec.stored = __atomic_load_n(&node->stored, __ATOMIC_RELAXED);
+    rec.initial_age = __atomic_load_n(&node->initial_age, __ATOMIC_RELAXED);
+    rec.must_revalidate = __atomic_load_n(&node->must_revalidate, __ATOMIC_RELAXED);
+    rec.uri_len = strlen(node->uri);
+    rec.header_len = node->header_len;
+    rec.etag_len = node->etag != NULL ? strlen(node->etag) : 0;
+    rec.last_modified_len = node->last_modified != NULL ? strlen(node->last_modified) : 0;
+    rec.content_len = node->content_len;
+
+    fwrite(&rec, sizeof(rec), 1, fp);
+    fwrite(node->uri, 1, rec.uri_len, fp);
+    fwrite(node->header, 1, rec.header_len, fp);
+    fwrite(node->etag, 1, rec.etag_len, fp);
+    fwrite(node->last_modified, 1, rec.last_modified_len, fp);
+
+    if (node->fd < 0) {
+        fwrite(node->content, 1, rec.content_len, fp);
+    }
+    else {
+        for (offset = 0; offset < rec.content_len; offset += n) {
+            n = rec.content_len - offset < MAXBUF ? rec.content_len - offset : MAXBUF;
+            if ((n = pread(node->fd, buf, n, offset)) <= 0)
+                return -1;
+            fwrite(buf, 1, n, fp);
+        }
+    }
+    return ferror(fp) ? -1 : 0;
+}
+
+/*
+ * cache_save - Write every entry to a snapshot at path. Each shard's nodes
+ *     are pinned under its lock and written after it is dropped, so
+ *     requests never wait on the disk. The file is written next to path
+ *     and renamed over it, so a crash midway leaves the last snapshot
+ *     intact. Returns the number of entries saved, or -1.
+ */
+int cache_save(Cache *cache, const char *path) {
+    char tmp[MAXLINE];
+    CacheNode **pinned = NULL, *node;
+    CacheList *list;
+    int i, j, q, n, cap = 0, saved = 0, rc = 0;
+    FILE *fp;
+
+    snprintf(tmp, MAXLINE, "%s.tmp", path);
+    if ((fp = fopen(tmp, "w")) == NULL)
+        return -1;
+    fwrite(CACHE_SNAP_MAGIC, 1, strlen(CACHE_SNAP_MAGIC), fp);
+
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        list = &cache->shards[i];
+
+        pthread_mutex_lock(&list->lock);
+        for (q = CACHE_SMALL, n = 0; q >= CACHE_MAIN; q--) {
+            for (node = list->queues[q].head; node != NULL; node = node->next) {
+                if (n == cap) {
+                    cap = cap > 0 ? 2 * cap : 256;
+                    pinned = Realloc(pinned, cap * sizeof(CacheNode *));
+                }
+                __atomic_add_fetch(&node->refcnt, 1, __ATOMIC_RELAXED);
+                pinned[n++] = node;
+            }
+        }
+        pthread_mutex_unlock(&list->lock);
+
+        for (j = 0; j < n; j++) {
+            if (rc == 0 && (rc = cache_save_node(fp, pinned[j])) == 0)
+                saved++;
+            cache_release(pinned[j]);
+        }
+    }
+    Free(pinned);
+
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0)
+        rc = -1;
+    if (fclose(fp) != 0 || rc < 0 || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return saved;
+}
+
+/*
+ * cache_load - Insert the entries of the snapshot at path, mapped rather
+ *     than read so the bodies are copied straight out of the page cache.
+ *     Entries larger than the cache's max_object are skipped. Loading
+ *     stops at the first damaged record, keeping what came before.
+ *     Returns the number of entries loaded, or -1 if there is no usable
+ *     snapshot.
+ */
+int cache_load(Cache *cache, const char *path) {
+    CacheSnapRecord rec;
+    CacheNode *node;
+    struct stat st;
+    char *map, *p, *end, *content;
+    char uri[MAXLINE];
+    int fd, loaded = 0;
+    size_t magic_len = strlen(CACHE_SNAP_MAGIC);
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || st.st_size < magic_len ||
+            (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    if (memcmp(map, CACHE_SNAP_MAGIC, magic_len) != 0) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    for (p = map + magic_len, end = map + st.st_size; end - p >= (long)sizeof(rec); ) {
+        memcpy(&rec, p, sizeof(rec));
+        p += sizeof(rec);
+
+        if (rec.uri_len <= 0 || rec.uri_len >= MAXLINE || rec.header_len <= 0 ||
+                rec.etag_len < 0 || rec.etag_len >= FRESH_VALIDATOR_MAX ||
+                rec.last_modified_len < 0 || rec.last_modified_len >= FRESH_VALIDATOR_MAX ||
+                rec.content_len < 0 ||
+                end - p < (long)rec.uri_len + rec.header_len + rec.etag_len +
+                    rec.last_modified_len + rec.content_len)
+            break;
+
+        // sound but too large for this cache, say saved with a file store
+        if (rec.content_len > cache->max_object) {
+            p += (long)rec.uri_len + rec.header_len + rec.etag_len +
+                rec.last_modified_len + rec.content_len;
+            continue;
+        }
+
+        memcpy(uri, p, rec.uri_len);
+        uri[rec.uri_len] = '\0';
+        p += rec.uri_len;
+
+        content = Malloc(rec.content_len > 0 ? rec.content_len : 1);
+        memcpy(content, p + rec.header_len + rec.etag_len + rec.last_modified_len, rec.content_len);
+        node = cache_node(cache, uri, cache_hash(uri), rec.content_len, content, -1);
+        node->expires = rec.expires;
+        node->stored = rec.stored;
+        node->initial_age = rec.initial_age;
+        node->must_revalidate = rec.must_revalidate;
+
+        node->header = Malloc(rec.header_len);
+        memcpy(node->header, p, rec.header_len);
+        node->header_len = rec.header_len;
+        p += rec.header_len;
+
+        if (rec.etag_len > 0)
+            node->etag = strndup(p, rec.etag_len);
+        p += rec.etag_len;
+        if (rec.last_modified_len > 0)
+            node->last_modified = strndup(p, rec.last_modified_len);
+        p += rec.last_modified_len + rec.content_len;
+
+        cache_insert(cache, node);
+        loaded++;
+    }
+
+    munmap(map, st.st_size);
+    return loaded;
+}
@@ -1,28 +1,148 @@
 #ifndef __CACHE_H__
 #define __CACHE_H__
+#include "sketch.h"
+#include "fresh.h"
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
+#define CACHE_STORE_SIZE (64L << 20)  /* default budget of a file store */
+#define CACHE_STORE_OBJECT 8  /* a file store takes objects up to 1/8 of its budget */
+#define CACHE_SHARDS 16       /* independently locked lists, a power of two */
+#define CACHE_BUCKETS 256     /* hash index size per shard, a power of two */
+#define CACHE_FLIGHT_WAIT 10  /* seconds to wait on another thread's fetch */
+#define CACHE_S3_SMALL 10     /* S3-FIFO: percent of a shard's bytes on probation */
+#define CACHE_S3_GHOSTS 256   /* S3-FIFO: hashes of failed probationers per shard */
+
+/* Eviction policies; one is picked for the whole cache at cache_init() */
+typedef enum {
+    CACHE_LRU,          /* relink on every hit, evict the least recently used */
+    CACHE_CLOCK,        /* set a bit on hit, give set nodes a second chance */
+    CACHE_S3FIFO,       /* small probation FIFO in front of a main FIFO */
+    CACHE_LFU,          /* fewest hits, aged so old favourites can leave */
+    CACHE_NPOLICIES
+} CachePolicy;
+
+/* Queues of a shard */
+#define CACHE_MAIN 0        /* every policy */
+#define CACHE_SMALL 1       /* S3-FIFO probation */
 
 typedef struct CacheNodeStruct {
     char *uri;
+    unsigned int hash;                      /* cache_hash(uri) */
     int content_len;
-    char *content_type;
-    char *content;
-    struct CacheNodeStruct *prev, *next;
+    char *header;                           /* status line and end-to-end headers */
+    int header_len;
+    char *content;                          /* NULL when spilled to fd */
+    int fd;                                 /* file store copy, or -1 */
+    struct CacheNodeStruct *prev, *next;    /* queue order, head goes first */
+    struct CacheNodeStruct *hnext;          /* hash bucket chain */
+    int refcnt;                             /* cache's own ref + readers */
+    int queue;                              /* CACHE_MAIN or CACHE_SMALL */
+    int freq;                               /* hits, as the policy counts them */
+    long prio;                              /* LFU: evicted lowest first */
+    long expires;                           /* time() from which it is stale */
+    long stored;                            /* time() it was received or revalidated */
+    long initial_age;                       /* its age at stored */
+    int must_revalidate;                    /* never serve it stale */
+    char *etag;                             /* validators, or NULL */
+    char *last_modified;
 } CacheNode;
 
-typedef struct CacheListStruct {
-    int free_space;
+typedef struct {
     CacheNode *head, *tail;
+    long bytes;
+} CacheQueue;
+
+/*
+ * A miss being fetched. Only the first thread to miss on a uri (the leader)
+ * goes to the server; threads missing on it meanwhile wait on done and look
+ * again once the leader has cached the object or given up on caching it.
+ */
+typedef struct CacheFlightStruct {
+    char *uri;
+    unsigned int hash;
+    int landed;                             /* the leader called cache_land() */
+    int waiters;                            /* last one out frees it */
+    pthread_cond_t done;
+    struct CacheFlightStruct *next;
+} CacheFlight;
+
+/* One shard: its own lock, queues, hash index and fetches in flight */
+typedef struct CacheListStruct {
+    pthread_mutex_t lock;
+    CacheQueue queues[2];
+    CacheNode *buckets[CACHE_BUCKETS];
+    CacheFlight *flights;
+    unsigned int ghosts[CACHE_S3_GHOSTS];   /* S3-FIFO, a ring */
+    int ghost_pos;
+    long age;                               /* LFU: prio of the last victim */
+    Sketch sketch;                          /* recent lookups, for admission */
 } CacheList;
 
-extern pthread_mutex_t mutex;
+/*
+ * The cache is split into CACHE_SHARDS lists picked by uri hash, so threads
+ * hitting different objects never contend on the same lock. All shards
+ * draw from one byte budget; an insert evicts from its own shard first
+ * and only moves on to the others if that shard is empty.
+ *
+ * With a store_dir (ideally on tmpfs), bodies are spilled into unlinked
+ * files there instead of staying on the heap, and hits are sent with
+ * sendfile(). The budget then covers the file store and can be far larger
+ * than MAX_CACHE_SIZE, and so can objects: max_object grows from
+ * MAX_OBJECT_SIZE to a CACHE_STORE_OBJECT share of the budget. Callers
+ * fetching such objects write them straight into a file from
+ * cache_store_open() and insert it with cache_add_file(), so large bodies
+ * never sit on the heap.
+ *
+ * Each shard picks its victims by the cache's policy. LRU relinks a node on
+ * every hit; CLOCK and S3-FIFO only bump a counter in the node, leaving the
+ * queues alone until eviction time, and LFU (with dynamic aging, so that
+ * objects popular long ago can still leave) scans its shard for the least
+ * valuable node.
+ *
+ * Every lookup is also counted in its shard's frequency sketch. With
+ * admission on, an object that would need evictions to fit is only let in
+ * if it has been asked for more often than its shard's next victim, times
+ * the number of such victims its size would take, so one-off large objects
+ * cannot flush many small popular ones.
+ *
+ * Entries past their expiry stay in the cache. A lookup still returns
+ * them, and it is up to the caller to check cache_fresh() and revalidate
+ * the entry with its validators; cache_refresh() extends it after a 304.
+ * Hits carry the server's end-to-end headers plus an Age from cache_age(),
+ * so clients and caches further down see how much lifetime is left.
+ *
+ * cache_save() writes all entries with their freshness to a snapshot file
+ * and cache_load() maps one back in, so a restart need not start cold.
+ */
+typedef struct CacheStruct {
+    CachePolicy policy;
+    int admission;      /* TinyLFU admission, off unless set after cache_init() */
+    long capacity;      /* byte budget */
+    long free_space;    /* updated with __atomic builtins */
+    char *store_dir;    /* file store directory, or NULL for the heap */
+    int max_object;     /* largest body cached */
+    CacheList shards[CACHE_SHARDS];
+} Cache;
 
-void cache_init(CacheList *list);
-void cache_renew(CacheList *list, CacheNode *node);
-void cache_append(CacheList *list, CacheNode *node);
-void cache_evict(CacheList *list);
-void cache_add(CacheList *list, char *uri, int content_len, char *content_type, char *content);
-CacheNode *cache_search(CacheList *list, char *uri);
+unsigned int cache_hash(const char *uri);
+void cache_init(Cache *cache, long capacity, char *store_dir, CachePolicy policy);
+int cache_policy(const char *name);
+const char *cache_policy_name(CachePolicy policy);
+int cache_evict(Cache *cache, CacheList *list);
+char *cache_header(HttpHead *head, const char *buf);
+int cache_store_open(Cache *cache);
+/* cache_add takes ownership of header and content, which must come from Malloc,
+ * and cache_add_file of header and the file */
+int cache_add(Cache *cache, char *uri, int content_len, char *header, char *content, Freshness *fresh);
+int cache_add_file(Cache *cache, char *uri, int content_len, char *header, int fd, Freshness *fresh);
+CacheNode *cache_search(Cache *cache, char *uri);
+CacheNode *cache_search_flight(Cache *cache, char *uri, int *leader, int *waited);
+void cache_land(Cache *cache, char *uri);
+void cache_release(CacheNode *node);
+int cache_fresh(CacheNode *node);
+long cache_age(CacheNode *node);
+void cache_refresh(CacheNode *node, Freshness *fresh);
+int cache_save(Cache *cache, const char *path);
+int cache_load(Cache *cache, const char *path);
 
-#endif /* __CACHE_H__ */
\ No newline at end of file
+#endif /* __CACHE_H__ */
@@ -0,0 +1,116 @@
+/*
+ * cachesim.c - Offline comparison of the cache's eviction policies, with
+ *     and without admission. The trace is replayed through the real cache
+ *     code (cache_search() and cache_add()), so what it reports is what the
+ *     proxy would have seen with the same budget, minus timing effects such
+ *     as coalescing.
+ */
+#include <limits.h>
+#include "csapp.h"
+#include "cache.h"
+#include "cachesim.h"
+
+typedef struct {
+    char *uri;
+    int size;
+    int status;
+} SimRequest;
+
+/* Parse one trace line; returns 0 for a request, -1 for anything else */
+static int sim_parse(char *line, SimRequest *req) {
+    char uri[MAXLINE];
+    char *p = line;
+    long size;
+    int status = 200, n;
+
+    while (*p == ' ' || *p == '=')
+        p++;
+    if (strncmp(p, "access ", 7) == 0)
+        p += 7;
+
+    if ((n = sscanf(p, "%s %ld %d", uri, &size, &status)) < 2 || size < 0 || size > INT_MAX)
+        return -1;
+
+    req->uri = strdup(uri);
+    req->size = size;
+    req->status = n == 3 ? status : 200;
+    return 0;
+}
+
+/* Read the whole trace; returns the request count, or -1 */
+static int sim_load(char *trace, SimRequest **reqs) {
+    char line[MAXLINE];
+    int n = 0, cap = 1024;
+    FILE *fp;
+
+    if ((fp = fopen(trace, "r")) == NULL) {
+        fprintf(stderr, "Could not open trace %s: %s\n", trace, strerror(errno));
+        return -1;
+    }
+
+    *reqs = Malloc(cap * sizeof(SimRequest));
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        if (n == cap) {
+            cap *= 2;
+            *reqs = Realloc(*reqs, cap * sizeof(SimRequest));
+        }
+        if (sim_parse(line, &(*reqs)[n]) == 0)
+            n++;
+    }
+
+    fclose(fp);
+    return n;
+}
+
+static void sim_replay(CachePolicy policy, int admission, SimRequest *reqs, int n, long capacity) {
+    Cache *cache = Malloc(sizeof(Cache));
+    long hits = 0, bytes = 0, hit_bytes = 0;
+    CacheNode *node;
+    int i;
+
+    cache_init(cache, capacity, NULL, policy);
+    cache->admission = admission;
+
+    for (i = 0; i < n; i++) {
+        bytes += reqs[i].size;
+        if ((node = cache_search(cache, reqs[i].uri)) != NULL) {
+            hits++;
+            hit_bytes += reqs[i].size;
+            cache_release(node);
+        }
+        else if (reqs[i].status == 200 && reqs[i].size <= MAX_OBJECT_SIZE) {
+            // bodies are never read, so untouched heap pages cost nothing;
+            // a trace has no headers, so nothing goes stale
+            cache_add(cache, reqs[i].uri, reqs[i].size, NULL, Malloc(reqs[i].size > 0 ? reqs[i].size : 1), NULL);
+        }
+    }
+
+    printf("%-8s %-9s %9ld %10.4f %10.4f\n", cache_policy_name(policy), admission ? "tinylfu" : "all", hits,
+            n > 0 ? (double)hits / n : 0.0, bytes > 0 ? (double)hit_bytes / bytes : 0.0);
+
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        while (cache_evict(cache, &cache->shards[i]))
+            ;
+    }
+    Free(cache);
+}
+
+int cachesim_run(char *trace, long capacity) {
+    SimRequest *reqs;
+    int n, i;
+
+    if ((n = sim_load(trace, &reqs)) < 0)
+        return -1;
+
+    printf("%d requests, %ld byte cache\n\n", n, capacity);
+    printf("%-8s %-9s %9s %10s %10s\n", "policy", "admission", "hits", "hit_ratio", "byte_ratio");
+    for (i = 0; i < CACHE_NPOLICIES; i++) {
+        sim_replay(i, 0, reqs, n, capacity);
+        sim_replay(i, 1, reqs, n, capacity);
+    }
+
+    for (i = 0; i < n; i++)
+        Free(reqs[i].uri);
+    Free(reqs);
+    return 0;
+}
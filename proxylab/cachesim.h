@@ -0,0 +1,15 @@
+#ifndef __CACHESIM_H__
+#define __CACHESIM_H__
+
+/*
+ * cachesim_run - Replay an access trace against a fresh cache of capacity
+ *     bytes under every eviction policy, with and without admission, and
+ *     print the object and byte hit ratios of each. Trace lines are
+ *     "uri bytes [status]", optionally after an "access" word, so the
+ *     proxy's own -v output works as is; other lines are skipped. Only
+ *     200s up to MAX_OBJECT_SIZE are cached, as in the proxy. Returns 0,
+ *     or -1 if the trace cannot be read.
+ */
+int cachesim_run(char *trace, long capacity);
+
+#endif /* __CACHESIM_H__ */
@@ -781,6 +781,39 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_writev - Robustly write every byte of an iovec array (unbuffered),
+ *     so scattered pieces go out in as few syscalls as possible. The array
+ *     is advanced in place past short writes.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    ssize_t nwritten;
+
+    while (iovcnt > 0) {
+        if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+            if (errno == EINTR)
+                nwritten = 0;
+            else
+                return -1;
+        }
+        total += nwritten;
+
+        // skip what was written, then trim a partly written entry
+        while (iovcnt > 0 && (size_t)nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+    return total;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -882,6 +915,44 @@ ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_readsomeb - Read whatever is available, up to n bytes (buffered).
+ *     Unlike rio_readnb, returns as soon as one read() delivers data, so
+ *     streamed bodies are not held back waiting for a full buffer.
+ */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n)
+{
+    return rio_read(rp, usrbuf, n);
+}
+
+/*
+ * rio_fillb - Move the unread bytes to the front of the internal buffer
+ *     and read more in behind them, consuming nothing. Lets a caller parse
+ *     straight out of rio_bufptr. Returns the number of bytes added, 0 on
+ *     EOF or when the buffer is already full, -1 on error.
+ */
+ssize_t rio_fillb(rio_t *rp)
+{
+    int cnt;
+
+    if (rp->rio_cnt < 0)
+        rp->rio_cnt = 0;
+    if (rp->rio_bufptr != rp->rio_buf) {
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+        rp->rio_bufptr = rp->rio_buf;
+    }
+    if (rp->rio_cnt == sizeof(rp->rio_buf))
+        return 0;
+
+    while ((cnt = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+                       sizeof(rp->rio_buf) - rp->rio_cnt)) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    rp->rio_cnt += cnt;
+    return cnt;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
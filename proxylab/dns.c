@@ -0,0 +1,419 @@
+#include "csapp.h"
+#include "cache.h"
+#include "dns.h"
+#include "log.h"
+
+#define DNS_RESOLVERS 4     /* resolver threads behind dns_lookup_async() */
+
+typedef struct DnsEntryStruct {
+    char *host;
+    unsigned int hash;
+    struct addrinfo *addrs;             /* our own copy, port left at 0 */
+    int error;                          /* getaddrinfo() result */
+    time_t expires;                     /* fresh while time() is below this */
+    int pinned;                         /* from the hosts file, never expires */
+    int pending;                        /* queued for a resolver thread */
+    int busy;                           /* dns_lookup() calls resolving it */
+    struct DnsEntryStruct *hnext;       /* bucket chain */
+    struct DnsEntryStruct *qnext;       /* resolver queue */
+} DnsEntry;
+
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_queued = PTHREAD_COND_INITIALIZER;
+static pthread_once_t dns_once = PTHREAD_ONCE_INIT;
+static DnsEntry *buckets[DNS_BUCKETS];
+static DnsEntry *queue_head, *queue_tail;
+static int notify[2] = { -1, -1 };     /* resolver threads -> event loop */
+static int nentries;                    /* over only while everything is in use */
+static time_t last_sweep;
+
+static int dns_fresh(DnsEntry *entry, time_t now) {
+    return entry->pinned || now < entry->expires;
+}
+
+/* Can entry be freed: not pinned, and no lookup or resolver is using it? */
+static int dns_unused(DnsEntry *entry) {
+    return !entry->pinned && !entry->pending && entry->busy == 0;
+}
+
+/* Unlink *link from its chain and free it; the caller holds dns_lock */
+static void dns_drop(DnsEntry **link) {
+    DnsEntry *entry = *link;
+
+    *link = entry->hnext;
+    dns_freeaddrinfo(entry->addrs);
+    Free(entry->host);
+    Free(entry);
+    nentries--;
+}
+
+/* Drop the expired, unused entries of a chain; the caller holds dns_lock */
+static void dns_prune(DnsEntry **link, time_t now) {
+    while (*link != NULL) {
+        if (dns_unused(*link) && !dns_fresh(*link, now))
+            dns_drop(link);
+        else
+            link = &(*link)->hnext;
+    }
+}
+
+/*
+ * dns_make_room - Before a new name is added, drop the expired entries of
+ *     its bucket. Once the table is full, also those of every bucket (at
+ *     most once a second), and failing that the first unused entry after
+ *     a rotating cursor, so that clients asking for random names cannot
+ *     grow the table. The caller holds dns_lock.
+ */
+static void dns_make_room(DnsEntry **bucket, time_t now) {
+    static int cursor;
+    DnsEntry **link;
+    int i;
+
+    dns_prune(bucket, now);
+    if (nentries < DNS_MAX_ENTRIES)
+        return;
+
+    if (now != last_sweep) {
+        last_sweep = now;
+        for (i = 0; i < DNS_BUCKETS; i++)
+            dns_prune(&buckets[i], now);
+    }
+
+    for (i = 0; i < DNS_BUCKETS && nentries >= DNS_MAX_ENTRIES; i++) {
+        cursor = (cursor + 1) & (DNS_BUCKETS - 1);
+        for (link = &buckets[cursor]; *link != NULL; link = &(*link)->hnext) {
+            if (dns_unused(*link)) {
+                dns_drop(link);
+                break;
+            }
+        }
+    }
+}
+
+/* Find (or create) the entry for host; the caller holds dns_lock */
+static DnsEntry *dns_entry(char *host) {
+    unsigned int hash = cache_hash(host);
+    DnsEntry **bucket = &buckets[hash & (DNS_BUCKETS - 1)];
+    DnsEntry *entry;
+
+    for (entry = *bucket; entry != NULL; entry = entry->hnext) {
+        if (entry->hash == hash && strcmp(entry->host, host) == 0)
+            return entry;
+    }
+
+    dns_make_room(bucket, time(NULL));
+    nentries++;
+    entry = Calloc(1, sizeof(DnsEntry));
+    entry->host = strdup(host);
+    entry->hash = hash;
+    entry->hnext = *bucket;
+    *bucket = entry;
+    return entry;
+}
+
+/* Ports come from parse_uri() and must be numeric */
+static int dns_port(char *port) {
+    char *end;
+    long n = strtol(port, &end, 10);
+
+    if (*port == '\0' || *end != '\0' || n < 0 || n > 65535)
+        return -1;
+    return n;
+}
+
+/*
+ * dns_copy - Copy an addrinfo list into blocks of our own, each holding
+ *     its sockaddr right behind it, with the port set to port.
+ */
+static struct addrinfo *dns_copy(struct addrinfo *list, int port) {
+    struct addrinfo *head = NULL, **link = &head;
+    struct addrinfo *p, *ai;
+
+    for (p = list; p != NULL; p = p->ai_next) {
+        ai = Malloc(sizeof(struct addrinfo) + p->ai_addrlen);
+        *ai = *p;
+        ai->ai_addr = (struct sockaddr *)(ai + 1);
+        memcpy(ai->ai_addr, p->ai_addr, p->ai_addrlen);
+        ai->ai_canonname = NULL;
+        ai->ai_next = NULL;
+
+        if (ai->ai_family == AF_INET)
+            ((struct sockaddr_in *)ai->ai_addr)->sin_port = htons(port);
+        else if (ai->ai_family == AF_INET6)
+            ((struct sockaddr_in6 *)ai->ai_addr)->sin6_port = htons(port);
+
+        *link = ai;
+        link = &ai->ai_next;
+    }
+    return head;
+}
+
+/*
+ * dns_interleave - Reorder a list to alternate address families, starting
+ *     with the family of the first address (RFC 8305, section 4), so that
+ *     racing connects try IPv6 and IPv4 in turn.
+ */
+static struct addrinfo *dns_interleave(struct addrinfo *list) {
+    struct addrinfo *first = NULL, *other = NULL, **f = &first, **o = &other;
+    struct addrinfo *head = NULL, **link = &head;
+    struct addrinfo *p, *next;
+
+    for (p = list; p != NULL; p = next) {
+        next = p->ai_next;
+        p->ai_next = NULL;
+        if (p->ai_family == list->ai_family) {
+            *f = p;
+            f = &p->ai_next;
+        }
+        else {
+            *o = p;
+            o = &p->ai_next;
+        }
+    }
+
+    while (first != NULL || other != NULL) {
+        if (first != NULL) {
+            *link = first;
+            link = &first->ai_next;
+            first = first->ai_next;
+        }
+        if (other != NULL) {
+            *link = other;
+            link = &other->ai_next;
+            other = other->ai_next;
+        }
+    }
+    return head;
+}
+
+void dns_freeaddrinfo(struct addrinfo *res) {
+    while (res != NULL) {
+        struct addrinfo *next = res->ai_next;
+        Free(res);
+        res = next;
+    }
+}
+
+/* The blocking part: ask the system resolver, no locks held */
+static int dns_resolve(char *host, struct addrinfo **addrs) {
+    struct addrinfo hints, *list;
+    int rc;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    if ((rc = getaddrinfo(host, NULL, &hints, &list)) != 0) {
+        *addrs = NULL;
+        return rc;
+    }
+
+    *addrs = dns_copy(list, 0);
+    freeaddrinfo(list);
+    return 0;
+}
+
+/*
+ * dns_store - Record an answer; the caller holds dns_lock. Names that do
+ *     not exist are remembered for DNS_NEG_TTL, other failures only for a
+ *     second so that waiters see them once. Returns the old addresses for
+ *     the caller to free outside the lock.
+ */
+static struct addrinfo *dns_store(DnsEntry *entry, int rc, struct addrinfo *addrs) {
+    struct addrinfo *old = entry->addrs;
+    time_t now = time(NULL);
+
+    entry->addrs = addrs;
+    entry->error = rc;
+    if (rc == 0)
+        entry->expires = now + DNS_TTL;
+    else if (rc == EAI_NONAME)
+        entry->expires = now + DNS_NEG_TTL;
+    else
+        entry->expires = now + 1;
+    return old;
+}
+
+/* Hand out a fresh entry's answer; the caller holds dns_lock */
+static int dns_answer(DnsEntry *entry, int port, struct addrinfo **res) {
+    if (entry->error != 0)
+        return entry->error;
+
+    *res = dns_interleave(dns_copy(entry->addrs, port));
+    return 0;
+}
+
+/*
+ * dns_lookup - Resolve host:port through the cache, calling getaddrinfo()
+ *     in this thread on a miss.
+ */
+int dns_lookup(char *host, char *port, struct addrinfo **res) {
+    DnsEntry *entry;
+    struct addrinfo *addrs, *old;
+    int nport, rc;
+
+    if ((nport = dns_port(port)) < 0)
+        return EAI_SERVICE;
+
+    pthread_mutex_lock(&dns_lock);
+    entry = dns_entry(host);
+    if (dns_fresh(entry, time(NULL))) {
+        rc = dns_answer(entry, nport, res);
+        pthread_mutex_unlock(&dns_lock);
+        return rc;
+    }
+    entry->busy++;     /* keeps it from being freed while we resolve */
+    pthread_mutex_unlock(&dns_lock);
+
+    rc = dns_resolve(host, &addrs);
+
+    pthread_mutex_lock(&dns_lock);
+    entry->busy--;
+    old = dns_store(entry, rc, addrs);
+    rc = dns_answer(entry, nport, res);
+    pthread_mutex_unlock(&dns_lock);
+
+    dns_freeaddrinfo(old);
+    return rc;
+}
+
+static void *dns_resolver(void *vargp) {
+    DnsEntry *entry;
+    struct addrinfo *addrs, *old;
+    int rc;
+
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        pthread_mutex_lock(&dns_lock);
+        while (queue_head == NULL)
+            pthread_cond_wait(&dns_queued, &dns_lock);
+        entry = queue_head;
+        if ((queue_head = entry->qnext) == NULL)
+            queue_tail = NULL;
+        pthread_mutex_unlock(&dns_lock);
+
+        rc = dns_resolve(entry->host, &addrs);
+
+        pthread_mutex_lock(&dns_lock);
+        old = dns_store(entry, rc, addrs);
+        entry->pending = 0;
+        pthread_mutex_unlock(&dns_lock);
+        dns_freeaddrinfo(old);
+
+        // a full pipe already tells the loop to look again
+        if (write(notify[1], "", 1) < 0 && errno != EAGAIN)
+            log_error("dns notify error: %s\n", strerror(errno));
+    }
+    return NULL;
+}
+
+/* Create the notify pipe and the resolver threads on first async use */
+static void dns_start(void) {
+    pthread_t tid;
+    int i;
+
+    if (pipe(notify) < 0) {
+        notify[0] = notify[1] = -1;
+        return;
+    }
+    fcntl(notify[0], F_SETFL, fcntl(notify[0], F_GETFL) | O_NONBLOCK);
+    fcntl(notify[1], F_SETFL, fcntl(notify[1], F_GETFL) | O_NONBLOCK);
+
+    for (i = 0; i < DNS_RESOLVERS; i++)
+        Pthread_create(&tid, NULL, dns_resolver, NULL);
+}
+
+int dns_notify_fd(void) {
+    pthread_once(&dns_once, dns_start);
+    return notify[0];
+}
+
+void dns_drain(void) {
+    char buf[64];
+
+    while (read(notify[0], buf, sizeof(buf)) > 0)
+        ;
+}
+
+/*
+ * dns_lookup_async - Like dns_lookup(), but a miss is queued for the
+ *     resolver threads and returns DNS_PENDING instead of blocking.
+ */
+int dns_lookup_async(char *host, char *port, struct addrinfo **res) {
+    DnsEntry *entry;
+    int nport, rc;
+
+    if ((nport = dns_port(port)) < 0)
+        return EAI_SERVICE;
+    if (dns_notify_fd() < 0)
+        return dns_lookup(host, port, res);
+
+    pthread_mutex_lock(&dns_lock);
+    entry = dns_entry(host);
+    if (dns_fresh(entry, time(NULL))) {
+        rc = dns_answer(entry, nport, res);
+        pthread_mutex_unlock(&dns_lock);
+        return rc;
+    }
+
+    if (!entry->pending) {
+        entry->pending = 1;
+        entry->qnext = NULL;
+        if (queue_tail != NULL)
+            queue_tail->qnext = entry;
+        else
+            queue_head = entry;
+        queue_tail = entry;
+        pthread_cond_signal(&dns_queued);
+    }
+    pthread_mutex_unlock(&dns_lock);
+    return DNS_PENDING;
+}
+
+/*
+ * dns_init - Preload the names of a hosts(5) style file ("address name
+ *     [alias...]" per line, # comments), or nothing if hosts_file is NULL.
+ */
+void dns_init(char *hosts_file) {
+    struct addrinfo hints, *list, **tail;
+    char line[MAXLINE];
+    char *addr, *name, *save;
+    DnsEntry *entry;
+    FILE *fp;
+
+    if (hosts_file == NULL)
+        return;
+    if ((fp = fopen(hosts_file, "r")) == NULL) {
+        fprintf(stderr, "Could not open hosts file %s: %s\n", hosts_file, strerror(errno));
+        return;
+    }
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST;
+
+    pthread_mutex_lock(&dns_lock);
+    while (fgets(line, MAXLINE, fp) != NULL) {
+        line[strcspn(line, "#")] = '\0';
+        if ((addr = strtok_r(line, " \t\r\n", &save)) == NULL)
+            continue;
+        if (getaddrinfo(addr, NULL, &hints, &list) != 0) {
+            fprintf(stderr, "Bad address in hosts file: %s\n", addr);
+            continue;
+        }
+
+        // a name listed on several lines collects all their addresses
+        while ((name = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            entry = dns_entry(name);
+            entry->pinned = 1;
+            entry->error = 0;
+            for (tail = &entry->addrs; *tail != NULL; tail = &(*tail)->ai_next)
+                ;
+            *tail = dns_copy(list, 0);
+        }
+        freeaddrinfo(list);
+    }
+    pthread_mutex_unlock(&dns_lock);
+
+    fclose(fp);
+}
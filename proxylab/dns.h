@@ -0,0 +1,34 @@
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+#define DNS_BUCKETS 256     /* name index size, a power of two */
+#define DNS_TTL 60          /* seconds a resolved name is trusted */
+#define DNS_NEG_TTL 5       /* seconds a name that does not exist is remembered */
+#define DNS_MAX_ENTRIES 4096    /* names remembered, hosts file included */
+#define DNS_PENDING 1       /* dns_lookup_async: answer not ready yet */
+
+/*
+ * Resolver cache in front of getaddrinfo(), keyed by host name. Answers are
+ * kept for DNS_TTL seconds (getaddrinfo does not report the record TTLs)
+ * and names that do not exist for DNS_NEG_TTL seconds. Names listed in the
+ * hosts file given to dns_init() are answered from it and never expire,
+ * which makes a stand-in resolver for tests. At most DNS_MAX_ENTRIES names
+ * are kept; expired ones are dropped first when room is needed.
+ *
+ * Lookups return 0 or a getaddrinfo() error code, and on success a private
+ * copy of the addresses with the port filled in, to be released with
+ * dns_freeaddrinfo(). dns_lookup() blocks on a miss; dns_lookup_async()
+ * instead hands the miss to a resolver thread, returns DNS_PENDING and
+ * makes dns_notify_fd() readable once some answer has come in, after
+ * which the caller drains it with dns_drain() and simply asks again.
+ */
+void dns_init(char *hosts_file);
+int dns_lookup(char *host, char *port, struct addrinfo **res);
+int dns_lookup_async(char *host, char *port, struct addrinfo **res);
+int dns_notify_fd(void);
+void dns_drain(void);
+void dns_freeaddrinfo(struct addrinfo *res);
+
+#endif /* __DNS_H__ */
@@ -0,0 +1,1041 @@
+/*
+ * evloop.c - Single-threaded, edge-triggered epoll front end for the proxy.
+ *
+ * Each accepted client gets an EvConn that walks through
+ *     EV_READ_REQUEST -> [EV_RESOLVING] -> EV_CONNECTING -> EV_SEND_REQUEST
+ *     -> EV_RELAY
+ * (or EV_READ_REQUEST -> EV_SEND_CACHED on a cache hit, EV_SEND_LOCAL for
+ * the stats page). An expired entry goes the long way with its validators,
+ * and a 304 from the server turns EV_RELAY into EV_SEND_CACHED; it is also
+ * sent if the server cannot be reached, unless it must not be served
+ * stale. Server names not in the resolver cache park the connection in
+ * EV_RESOLVING until the resolver threads poke the notify pipe, so the
+ * loop never blocks in getaddrinfo(). A connect that has not completed
+ * after UPSTREAM_STAGGER ms is joined by one to the server's next address
+ * (happy eyeballs), up to UPSTREAM_MAX_RACE in flight; the first to
+ * complete becomes the server socket and the others are closed. The whole
+ * EV_CONNECTING phase is bounded by connect_timeout. Every socket is
+ * registered once with EPOLLIN | EPOLLOUT | EPOLLET, and every wakeup
+ * simply advances the state machine until the next read or write would
+ * block.
+ */
+#include <sys/epoll.h>
+#include "proxy.h"
+#include "evloop.h"
+#include "zcopy.h"
+#include "dns.h"
+#include "log.h"
+#include "upstream.h"
+#include "stats.h"
+
+/* Connection states */
+typedef enum {
+    EV_READ_REQUEST,    /* reading the client's request head */
+    EV_RESOLVING,       /* waiting for the resolver threads */
+    EV_CONNECTING,      /* non-blocking connect() to the server in flight */
+    EV_SEND_REQUEST,    /* forwarding the rewritten request to the server */
+    EV_RELAY,           /* relaying the server's response to the client */
+    EV_SEND_CACHED,     /* writing a cached response to the client */
+    EV_SEND_LOCAL,      /* writing a response of our own from out */
+    EV_CLOSED           /* waiting to be reaped at the end of the batch */
+} EvState;
+
+struct EvConnStruct;
+
+/* What epoll hands back: which socket woke up, and whose it is */
+typedef struct {
+    int fd;
+    struct EvConnStruct *conn;
+} EvEndpoint;
+
+typedef struct EvConnStruct {
+    EvState state;
+    EvEndpoint client, server;
+
+    char request[MAXLINE];      /* client request head */
+    int request_len;
+    HttpHead head;              /* parsed incrementally as request fills */
+
+    char *out;                  /* pending bytes for EV_SEND_* states */
+    int out_len, out_pos;
+    CacheNode *hit;             /* pinned cache entry sent after out, or revalidated */
+    int hit_pos;
+    char age[32];               /* hit's Age line, fixed when sending starts */
+    int age_len;
+
+    char relay[MAXBUF];         /* server -> client staging buffer */
+    int relay_len, relay_pos;
+    int server_eof;
+    int pipefd[2];              /* splice() pipe once the body is uncached */
+    long pipe_pending;          /* bytes sitting in the pipe */
+
+    char uri2[MAXLINE];         /* cache key */
+    char shost[MAXLINE];        /* server to connect to */
+    char sport[MAXLINE];
+    char *response;             /* copy of the response for the cache */
+    int response_len;           /* -1 once it can no longer be cached */
+    int response_head;          /* head length once the body goes to store_fd, -1 if it never will */
+    int store_fd;               /* file store copy of the body, or -1 */
+
+    struct addrinfo *addrs, *next_addr;
+    EvEndpoint attempts[UPSTREAM_MAX_RACE];  /* connects racing, fd -1 if free */
+    int nattempts;
+    long connect_deadline;              /* ms, for the whole EV_CONNECTING */
+    long attempt_deadline;              /* ms, before trying next_addr */
+    int timed;                          /* on the connecting list */
+    struct EvConnStruct *next_timed;
+    struct EvConnStruct *next_wait;     /* on the resolving list */
+    struct EvConnStruct *next_dead;
+
+    long t_start;               /* us, request head complete */
+    long t_connect;             /* us, first connect attempt */
+    long t_sent;                /* us, request written; 0 once the response arrives */
+} EvConn;
+
+#define EV_RESPONSE_MAX (MAX_OBJECT_SIZE + MAXLINE)
+
+static int epfd;
+static EvConn *dead;        /* closed this batch, freed once it is over */
+static EvConn *resolving;   /* in EV_RESOLVING */
+static EvConn *connecting;  /* with connect deadlines, EV_CONNECTING or just left it */
+static EvEndpoint dns_ep;   /* the resolver notify pipe */
+
+static void ev_advance(EvConn *c);
+static void ev_fail(EvConn *c);
+
+/* Close the connects still racing, e.g. once one of them has won */
+static void ev_drop_attempts(EvConn *c) {
+    int i;
+
+    for (i = 0; i < UPSTREAM_MAX_RACE; i++) {
+        if (c->attempts[i].fd >= 0) {
+            close(c->attempts[i].fd);
+            c->attempts[i].fd = -1;
+        }
+    }
+    c->nattempts = 0;
+}
+
+static void ev_close(EvConn *c) {
+    if (c->state == EV_CLOSED)
+        return;
+
+    c->state = EV_CLOSED;
+    close(c->client.fd);
+    if (c->server.fd >= 0)
+        close(c->server.fd);
+    ev_drop_attempts(c);
+    if (c->store_fd >= 0)
+        close(c->store_fd);
+    if (c->pipefd[0] >= 0) {
+        close(c->pipefd[0]);
+        close(c->pipefd[1]);
+    }
+
+    c->next_dead = dead;
+    dead = c;
+}
+
+static void ev_reap(void) {
+    while (dead != NULL) {
+        EvConn *c = dead;
+        dead = c->next_dead;
+
+        if (c->out != NULL)
+            Free(c->out);
+        if (c->response != NULL)
+            Free(c->response);
+        if (c->addrs != NULL)
+            dns_freeaddrinfo(c->addrs);
+        if (c->hit != NULL)
+            cache_release(c->hit);
+        Free(c);
+    }
+}
+
+static int ev_watch(EvEndpoint *ep) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = ep;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, ep->fd, &ev);
+}
+
+/* Hand a watched fd over to ep, so its events come back as ep's */
+static int ev_rewatch(EvEndpoint *ep) {
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = ep;
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, ep->fd, &ev);
+}
+
+static void ev_accept(int listenfd) {
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    int i, connfd;
+
+    while (1) {
+        clientlen = sizeof(clientaddr);
+        connfd = accept(listenfd, (SA *)&clientaddr, &clientlen);
+        if (connfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                log_error("accept error: %s\n", strerror(errno));
+            return;
+        }
+        fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+
+        EvConn *c = Calloc(1, sizeof(EvConn));
+        c->state = EV_READ_REQUEST;
+        c->client.fd = connfd;
+        c->client.conn = c;
+        c->server.fd = -1;
+        c->server.conn = c;
+        for (i = 0; i < UPSTREAM_MAX_RACE; i++) {
+            c->attempts[i].fd = -1;
+            c->attempts[i].conn = c;
+        }
+        c->pipefd[0] = c->pipefd[1] = -1;
+        c->store_fd = -1;
+        http_head_init(&c->head);
+
+        if (ev_watch(&c->client) < 0)
+            ev_close(c);
+    }
+}
+
+/*
+ * ev_write_out - Flush c->out to fd. Returns 1 when everything is written,
+ *     0 if the socket would block, -1 on error.
+ */
+static int ev_write_out(EvConn *c, int fd) {
+    ssize_t n;
+
+    while (c->out_pos < c->out_len) {
+        if ((n = write(fd, c->out + c->out_pos, c->out_len - c->out_pos)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        c->out_pos += n;
+    }
+
+    Free(c->out);
+    c->out = NULL;
+    c->out_len = c->out_pos = 0;
+    return 1;
+}
+
+/*
+ * ev_read_request - Read until the blank line ending the request head.
+ *     Returns 1 when it is complete, 0 if more input is needed, -1 if the
+ *     connection was closed.
+ */
+static int ev_read_request(EvConn *c) {
+    ssize_t n;
+    int rc;
+
+    while (1) {
+        if (c->request_len == MAXLINE - 1) {
+            ev_close(c);   /* request head too long */
+            return -1;
+        }
+
+        n = read(c->client.fd, c->request + c->request_len, MAXLINE - 1 - c->request_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            ev_close(c);
+            return -1;
+        }
+        if (n == 0) {
+            ev_close(c);
+            return -1;
+        }
+
+        c->request_len += n;
+        if ((rc = http_parse_request(&c->head, c->request, c->request_len)) > 0)
+            return 1;
+        if (rc < 0) {
+            ev_close(c);
+            return -1;
+        }
+    }
+}
+
+/*
+ * ev_connect_next - Race one more address: start a non-blocking connect to
+ *     the next address that takes one, next to those already in flight,
+ *     and put the connection on the deadline list. Gives up on the server
+ *     once no address is left and no connect is in flight. The caller
+ *     makes sure an attempt slot is free.
+ */
+static void ev_connect_next(EvConn *c) {
+    struct addrinfo *p;
+    EvEndpoint *ep;
+    int fd;
+
+    for (ep = c->attempts; ep->fd >= 0; ep++)
+        ;
+
+    while ((p = c->next_addr) != NULL) {
+        c->next_addr = p->ai_next;
+
+        if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol)) < 0)
+            continue;
+
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0 || errno == EINPROGRESS) {
+            ep->fd = fd;
+            if (ev_watch(ep) < 0) {
+                ep->fd = -1;
+                close(fd);
+                continue;
+            }
+            c->nattempts++;
+            c->state = EV_CONNECTING;
+            c->attempt_deadline = upstream_now_ms() + UPSTREAM_STAGGER;
+            if (!c->timed) {
+                c->timed = 1;
+                c->next_timed = connecting;
+                connecting = c;
+            }
+            return;
+        }
+
+        close(fd);
+    }
+
+    if (c->nattempts == 0)
+        ev_fail(c);
+}
+
+/*
+ * ev_send_cached - Write the node's stored header block, its Age, our
+ *     Connection line and the blank line, then the body straight out of
+ *     the pinned node, or from its file with sendfile(). hit_pos counts
+ *     bytes of all of that, so a blocked write resumes where it stopped.
+ *     Same return values as ev_write_out().
+ */
+static int ev_send_cached(EvConn *c) {
+    CacheNode *node = c->hit;
+    int head_len = node->header_len + c->age_len + strlen(header_connection) + 2;
+    int total = head_len + (node->fd >= 0 ? 0 : node->content_len);
+    struct iovec iov[5];
+    char *base[5];
+    int len[5];
+    int i, iovcnt, skip, rc;
+    ssize_t n;
+
+    base[0] = node->header;
+    len[0] = node->header_len;
+    base[1] = c->age;
+    len[1] = c->age_len;
+    base[2] = header_connection;
+    len[2] = strlen(header_connection);
+    base[3] = "\r\n";
+    len[3] = 2;
+    base[4] = node->content;
+    len[4] = node->fd >= 0 ? 0 : node->content_len;
+
+    while (c->hit_pos < total) {
+        // whatever is left of the five pieces
+        for (i = 0, iovcnt = 0, skip = c->hit_pos; i < 5; i++) {
+            if (skip >= len[i]) {
+                skip -= len[i];
+                continue;
+            }
+            iov[iovcnt].iov_base = base[i] + skip;
+            iov[iovcnt].iov_len = len[i] - skip;
+            iovcnt++;
+            skip = 0;
+        }
+
+        if ((n = writev(c->client.fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        c->hit_pos += n;
+    }
+
+    if (node->fd >= 0) {
+        long offset = c->hit_pos - head_len;
+
+        rc = zc_sendfile(c->client.fd, node->fd, &offset, node->content_len);
+        c->hit_pos = head_len + offset;
+        return rc == 0 ? 1 : (rc == 1 ? 0 : -1);
+    }
+    return 1;
+}
+
+static void ev_serve_cached(EvConn *c, CacheNode *node) {
+    c->hit = node;
+    c->hit_pos = 0;
+    c->age_len = sprintf(c->age, "Age: %ld\r\n", cache_age(node));
+    c->state = EV_SEND_CACHED;
+}
+
+/*
+ * ev_fail - Give up on the server. The expired entry being revalidated is
+ *     sent instead if it may be served stale; otherwise the client is
+ *     dropped.
+ */
+static void ev_fail(EvConn *c) {
+    if (c->hit == NULL || c->hit->must_revalidate) {
+        stats_count(STAT_ERRORS, 1);
+        ev_close(c);
+        return;
+    }
+
+    log_info(" * Server unavailable, serving stale copy of %s\n", c->uri2);
+    ev_drop_attempts(c);
+    if (c->server.fd >= 0) {
+        close(c->server.fd);
+        c->server.fd = -1;
+    }
+    ev_serve_cached(c, c->hit);
+    ev_advance(c);
+}
+
+/*
+ * ev_resolve - Look up the server without blocking: connect right away on
+ *     a resolver cache hit, park the connection in EV_RESOLVING otherwise.
+ */
+static void ev_resolve(EvConn *c) {
+    int rc;
+
+    if ((rc = dns_lookup_async(c->shost, c->sport, &c->addrs)) == DNS_PENDING) {
+        c->state = EV_RESOLVING;
+        c->next_wait = resolving;
+        resolving = c;
+        return;
+    }
+
+    if (rc != 0) {
+        log_warn("getaddrinfo failed (%s:%s): %s\n", c->shost, c->sport, gai_strerror(rc));
+        c->addrs = NULL;
+        ev_fail(c);
+        return;
+    }
+
+    c->next_addr = c->addrs;
+    c->connect_deadline = upstream_now_ms() + connect_timeout;
+    c->t_connect = stats_now_us();
+    ev_connect_next(c);
+}
+
+/*
+ * ev_expire - Enforce connect deadlines: race the next address against
+ *     slow attempts, close connections out of time, and drop the ones no
+ *     longer connecting from the list. Runs before every ev_reap().
+ *     Returns the ms until the next deadline, or -1 if there is none.
+ */
+static int ev_expire(void) {
+    EvConn **link = &connecting, *c;
+    long now = upstream_now_ms(), next = -1, due;
+
+    while ((c = *link) != NULL) {
+        if (c->state == EV_CONNECTING && now >= c->connect_deadline) {
+            log_warn(" - Connect to %s:%s timed out\n", c->shost, c->sport);
+            ev_fail(c);
+        }
+        else if (c->state == EV_CONNECTING && c->next_addr != NULL &&
+                c->nattempts < UPSTREAM_MAX_RACE && now >= c->attempt_deadline) {
+            ev_connect_next(c);
+        }
+
+        if (c->state != EV_CONNECTING) {
+            c->timed = 0;
+            *link = c->next_timed;
+            continue;
+        }
+
+        if (c->next_addr != NULL && c->nattempts < UPSTREAM_MAX_RACE)
+            due = c->attempt_deadline;
+        else
+            due = c->connect_deadline;
+        if (next < 0 || due < next)
+            next = due;
+        link = &c->next_timed;
+    }
+
+    return next < 0 ? -1 : (next > now ? next - now : 0);
+}
+
+/* Some answers came in: retry every parked connection */
+static void ev_resolved(void) {
+    EvConn *c, *waiting = resolving;
+
+    dns_drain();
+    resolving = NULL;
+    while ((c = waiting) != NULL) {
+        waiting = c->next_wait;
+        ev_resolve(c);
+        if (c->state != EV_CLOSED)
+            ev_advance(c);
+    }
+}
+
+/* Answer with an error page of our own and close */
+static void ev_send_error(EvConn *c, int status, const char *reason) {
+    c->out = error_page(status, reason, &c->out_len);
+    c->out_pos = 0;
+    c->state = EV_SEND_LOCAL;
+}
+
+/*
+ * ev_start - Parse a complete request head and either answer it from the
+ *     cache or build the upstream request and start connecting.
+ */
+static void ev_start(EvConn *c) {
+    char shost[MAXLINE], sport[MAXLINE], spath[MAXLINE];
+    char *buf = c->request;
+    HttpHead *head = &c->head;
+    HttpHeader *h;
+    CacheNode *node;
+    int i, len, cond, has_host = 0;
+
+    c->t_start = stats_now_us();
+    if (!http_slice_is(buf, head->method, "GET")) {
+        ev_close(c);
+        return;
+    }
+    if (parse_uri(buf, head->uri, shost, sport, spath) < 0) {
+        ev_send_error(c, 400, "Bad Request");
+        return;
+    }
+
+    if (strcasecmp(shost, STATS_HOST) == 0) {
+        c->out = stats_page(spath, header_connection, &c->out_len);
+        c->out_pos = 0;
+        c->state = EV_SEND_LOCAL;
+        return;
+    }
+    stats_count(STAT_REQUESTS, 1);
+
+    // a truncated key could name some other object
+    if (snprintf(c->uri2, MAXLINE, "%s:%s%s", shost, sport, spath) >= MAXLINE) {
+        ev_send_error(c, 414, "URI Too Long");
+        return;
+    }
+    if ((node = cache_search(cache, c->uri2)) != NULL && cache_fresh(node)) {
+        stats_count(STAT_HITS, 1);
+        ev_serve_cached(c, node);
+        return;
+    }
+    stats_count(STAT_MISSES, 1);
+
+    // an expired entry stays pinned in hit while we revalidate it
+    c->hit = node;
+    if (node != NULL)
+        stats_count(STAT_STALE, 1);
+
+    // rewrite the request head for the server; each header grows by at most
+    // CRLF, and an expired entry adds its validators and a missing Host
+    c->out = Malloc(c->request_len + 2 * head->nheaders + strlen(spath) + strlen(header_connection) +
+            4 * FRESH_VALIDATOR_MAX + strlen(shost) + strlen(sport) + 10);
+    c->out_len = sprintf(c->out, "GET %s HTTP/1.0\r\n", spath);
+    c->out_pos = 0;
+
+    for (i = 0; i < head->nheaders; i++) {
+        h = &head->headers[i];
+
+        // ignore Connection/Proxy-Connection/Keep-Alive headers
+        if (http_slice_is(buf, h->name, "Proxy-Connection") ||
+                http_slice_is(buf, h->name, "Connection") ||
+                http_slice_is(buf, h->name, "Keep-Alive"))
+            continue;
+        if (http_slice_is(buf, h->name, "Host"))
+            has_host = 1;
+
+        // the client's validators give way to the entry's
+        cond = http_slice_is(buf, h->name, "If-None-Match") || http_slice_is(buf, h->name, "If-Modified-Since");
+        if (cond && node != NULL)
+            continue;
+
+        len = h->value.off + h->value.len - h->name.off;
+        memcpy(c->out + c->out_len, buf + h->name.off, len);
+        memcpy(c->out + c->out_len + len, "\r\n", 2);
+        c->out_len += len + 2;
+    }
+    if (node != NULL && node->etag != NULL)
+        c->out_len += sprintf(c->out + c->out_len, "If-None-Match: %s\r\n", node->etag);
+    if (node != NULL && node->last_modified != NULL)
+        c->out_len += sprintf(c->out + c->out_len, "If-Modified-Since: %s\r\n", node->last_modified);
+    if (!has_host)
+        c->out_len += host_header(c->out + c->out_len, shost, sport);
+    c->out_len += sprintf(c->out + c->out_len, "%s\r\n", header_connection);
+    stats_time(STAT_PARSE, stats_now_us() - c->t_start);
+
+    // resolve and connect to server
+    strcpy(c->shost, shost);
+    strcpy(c->sport, sport);
+    ev_resolve(c);
+}
+
+/* Give up on caching the response */
+static void ev_unkeep(EvConn *c) {
+    if (c->response != NULL)
+        Free(c->response);
+    c->response = NULL;
+    c->response_len = -1;
+    if (c->store_fd >= 0) {
+        close(c->store_fd);
+        c->store_fd = -1;
+    }
+}
+
+/*
+ * ev_store - Once the response head is in, move the body of a cacheable
+ *     200 with a plain body into the file store, leaving the head on the
+ *     heap. Chunked bodies stay on the heap to be decoded in ev_finish.
+ */
+static void ev_store(EvConn *c) {
+    HttpHead head;
+    HttpHeader *h;
+    Freshness fresh;
+    int head_len;
+
+    http_head_init(&head);
+    if ((head_len = http_parse_response(&head, c->response, c->response_len)) == 0)
+        return;
+
+    c->response_head = -1;
+    if (head_len < 0 || head.status != 200)
+        return;
+    if ((h = http_find_header(&head, c->response, "Transfer-Encoding")) != NULL)
+        return;
+    if ((h = http_find_header(&head, c->response, "Content-length")) != NULL &&
+            atoi(c->response + h->value.off) > cache->max_object)
+        return;
+    fresh_parse(&head, c->response, time(NULL), &fresh);
+    if (!fresh.store || (c->store_fd = cache_store_open(cache)) < 0)
+        return;
+
+    c->response_head = head_len;
+    if (rio_writen(c->store_fd, c->response + head_len, c->response_len - head_len) < 0)
+        ev_unkeep(c);
+    else
+        c->response = Realloc(c->response, head_len);
+}
+
+/* Keep a copy of relayed bytes while the response is still cacheable */
+static void ev_keep(EvConn *c, char *data, int len) {
+    if (c->response_len < 0)
+        return;
+
+    if (c->store_fd >= 0) {
+        if (c->response_len + len - c->response_head > cache->max_object ||
+                rio_writen(c->store_fd, data, len) < 0)
+            ev_unkeep(c);
+        else
+            c->response_len += len;
+        return;
+    }
+
+    if (c->response_len + len > EV_RESPONSE_MAX) {
+        ev_unkeep(c);
+        return;
+    }
+
+    if (c->response == NULL)
+        c->response = Malloc(EV_RESPONSE_MAX);
+    memcpy(c->response + c->response_len, data, len);
+    c->response_len += len;
+
+    if (c->response_head == 0 && cache->store_dir != NULL)
+        ev_store(c);
+}
+
+/*
+ * ev_splice - Zero-copy relay for the rest of a body that will not be
+ *     cached. Same return values as ev_relay, plus 2 if splice() does not
+ *     work for these sockets.
+ */
+static int ev_splice(EvConn *c) {
+    long moved = 0;
+    int rc;
+
+    if (c->pipefd[0] < 0 && pipe(c->pipefd) < 0)
+        return 2;
+
+    rc = zc_splice(c->server.fd, c->client.fd, c->pipefd, -1, &moved, &c->pipe_pending);
+    stats_count(STAT_BYTES_ORIGIN, moved);
+    if (rc == 0) {
+        c->server_eof = 1;
+        return 1;
+    }
+    if (rc == 1)
+        return 0;
+
+    if (moved == 0 && c->pipe_pending == 0 && (errno == EINVAL || errno == ENOSYS))
+        return 2;
+    return -1;
+}
+
+/*
+ * ev_relay - Shovel bytes from the server to the client. Returns 1 when the
+ *     server has closed and everything was delivered, 0 if blocked, -1 on
+ *     error.
+ */
+static int ev_relay(EvConn *c) {
+    ssize_t n;
+    int rc;
+
+    while (1) {
+        if (c->relay_pos < c->relay_len) {
+            n = write(c->client.fd, c->relay + c->relay_pos, c->relay_len - c->relay_pos);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 0;
+                return -1;
+            }
+            c->relay_pos += n;
+            continue;
+        }
+
+        if (c->server_eof)
+            return 1;
+
+        if (zerocopy && c->response_len < 0) {
+            if ((rc = ev_splice(c)) != 2)
+                return rc;
+            zerocopy = 0;   /* unsupported, stop trying */
+        }
+
+        n = read(c->server.fd, c->relay, MAXBUF);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        if (n == 0) {
+            c->server_eof = 1;
+        }
+        else {
+            if (c->t_sent > 0) {
+                stats_time(STAT_FIRST_BYTE, stats_now_us() - c->t_sent);
+                c->t_sent = 0;
+            }
+            stats_count(STAT_BYTES_ORIGIN, n);
+            c->relay_len = n;
+            c->relay_pos = 0;
+            ev_keep(c, c->relay, n);
+        }
+    }
+}
+
+/*
+ * ev_revalidate - Collect the head of the server's answer to a revalidation
+ *     in the relay buffer without passing it on. On a 304 the entry is
+ *     refreshed and sent from the cache; anything else drops it and goes
+ *     to the client through ev_relay as usual. Returns 1 once decided, 0
+ *     if blocked, -1 if the server failed before a head arrived.
+ */
+static int ev_revalidate(EvConn *c) {
+    Freshness fresh;
+    HttpHead head;
+    int head_len = 0;
+    ssize_t n;
+
+    while (1) {
+        n = read(c->server.fd, c->relay + c->relay_len, MAXBUF - c->relay_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        if (n == 0) {
+            if (c->relay_len == 0)
+                return -1;
+            c->server_eof = 1;
+            break;
+        }
+
+        if (c->t_sent > 0) {
+            stats_time(STAT_FIRST_BYTE, stats_now_us() - c->t_sent);
+            c->t_sent = 0;
+        }
+        stats_count(STAT_BYTES_ORIGIN, n);
+        c->relay_len += n;
+
+        // a head too long for the buffer is simply relayed
+        http_head_init(&head);
+        if ((head_len = http_parse_response(&head, c->relay, c->relay_len)) != 0 || c->relay_len == MAXBUF)
+            break;
+    }
+
+    if (head_len > 0 && head.status == 304) {
+        fresh_parse(&head, c->relay, time(NULL), &fresh);
+        cache_refresh(c->hit, &fresh);
+        stats_count(STAT_REVALIDATED, 1);
+
+        close(c->server.fd);
+        c->server.fd = -1;
+        c->relay_len = 0;
+        ev_serve_cached(c, c->hit);
+        return 1;
+    }
+
+    cache_release(c->hit);
+    c->hit = NULL;
+    c->relay_pos = 0;
+    ev_keep(c, c->relay, c->relay_len);
+    return 1;
+}
+
+/* Decode a complete chunked body in place; returns its length or -1 */
+static int ev_dechunk(char *body, int len) {
+    char *in = body, *end = body + len, *out = body, *eol;
+    long size;
+
+    while (1) {
+        if ((eol = memchr(in, '\n', end - in)) == NULL)
+            return -1;
+        size = strtol(in, NULL, 16);
+        in = eol + 1;
+
+        if (size == 0)
+            return out - body;   /* trailers are not kept */
+        if (size < 0 || size + 2 > end - in)
+            return -1;
+
+        memmove(out, in, size);
+        out += size;
+        in += size + 2;
+    }
+}
+
+/*
+ * ev_finish - Insert a complete 200 response into the cache if it fits.
+ *     With a file store its body is already in store_fd and only the head
+ *     is in response.
+ */
+static void ev_finish(EvConn *c) {
+    HttpHead head;
+    HttpHeader *h;
+    CacheNode *node;
+    Freshness fresh;
+    char *body, *stored;
+    int head_len, body_len, content_len = -1, chunked = 0, filled;
+
+    if (c->response_len <= 0)
+        return;
+
+    http_head_init(&head);
+    if ((head_len = http_parse_response(&head, c->response,
+                    c->store_fd >= 0 ? c->response_head : c->response_len)) <= 0 ||
+            head.status != 200)
+        return;
+    body = c->response + head_len;
+    body_len = c->response_len - head_len;
+
+    if ((h = http_find_header(&head, c->response, "Content-length")) != NULL)
+        content_len = atoi(c->response + h->value.off);
+    fresh_parse(&head, c->response, time(NULL), &fresh);
+    if (!fresh.store)
+        return;
+    if ((h = http_find_header(&head, c->response, "Transfer-Encoding")) != NULL)
+        chunked = http_slice_ends(c->response, h->value, "chunked");
+
+    if (chunked)
+        body_len = ev_dechunk(body, body_len);
+    else if (content_len >= 0 && content_len != body_len)
+        return;   /* server closed early */
+
+    if (body_len < 0 || body_len > (c->store_fd >= 0 ? cache->max_object : MAX_OBJECT_SIZE))
+        return;
+
+    // another connection may have filled it in the meantime; an expired
+    // copy is replaced
+    if ((node = cache_search(cache, c->uri2)) != NULL) {
+        filled = cache_fresh(node);
+        cache_release(node);
+        if (filled)
+            return;
+    }
+
+    // hand the store file, or the buffer with the body moved to the front,
+    // over to the cache once the headers to keep are out of it
+    stored = cache_header(&head, c->response);
+    if (c->store_fd >= 0) {
+        cache_add_file(cache, c->uri2, body_len, stored, c->store_fd, &fresh);
+        c->store_fd = -1;
+        return;
+    }
+    memmove(c->response, body, body_len);
+    c->response = Realloc(c->response, body_len > 0 ? body_len : 1);
+    cache_add(cache, c->uri2, body_len, stored, c->response, &fresh);
+    c->response = NULL;
+}
+
+static void ev_advance(EvConn *c) {
+    int rc;
+
+    while (1) {
+        switch (c->state) {
+        case EV_READ_REQUEST:
+            if (ev_read_request(c) <= 0)
+                return;
+            ev_start(c);
+            break;
+
+        case EV_SEND_REQUEST:
+            if ((rc = ev_write_out(c, c->server.fd)) <= 0) {
+                if (rc < 0)
+                    ev_fail(c);
+                return;
+            }
+            c->t_sent = stats_now_us();
+            c->state = EV_RELAY;
+            break;
+
+        case EV_RELAY:
+            if (c->hit != NULL) {
+                if ((rc = ev_revalidate(c)) <= 0) {
+                    if (rc < 0)
+                        ev_fail(c);
+                    return;
+                }
+                break;
+            }
+            if ((rc = ev_relay(c)) <= 0) {
+                if (rc < 0) {
+                    stats_count(STAT_ERRORS, 1);
+                    ev_close(c);
+                }
+                return;
+            }
+            stats_time(STAT_TOTAL, stats_now_us() - c->t_start);
+            ev_finish(c);
+            ev_close(c);
+            return;
+
+        case EV_SEND_CACHED:
+            if ((rc = ev_send_cached(c)) == 0)
+                return;
+            if (rc > 0) {
+                stats_count(STAT_BYTES_CACHE, c->hit_pos);
+                stats_time(STAT_TOTAL, stats_now_us() - c->t_start);
+            }
+            else {
+                stats_count(STAT_ERRORS, 1);
+            }
+            ev_close(c);
+            return;
+
+        case EV_SEND_LOCAL:
+            if (ev_write_out(c, c->client.fd) != 0)
+                ev_close(c);
+            return;
+
+        case EV_RESOLVING:
+        case EV_CONNECTING:
+        case EV_CLOSED:
+            return;
+        }
+    }
+}
+
+static void ev_handle(EvEndpoint *ep, uint32_t events) {
+    EvConn *c = ep->conn;
+    struct sockaddr_storage peer;
+    socklen_t len;
+    int err = 0;
+
+    if (ep != &c->client && ep != &c->server) {
+        // one of the racing connects; it may have lost or failed earlier this batch
+        if (c->state != EV_CONNECTING || ep->fd < 0)
+            return;
+
+        len = sizeof(err);
+        if (getsockopt(ep->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+            err = errno;
+
+        if (err != 0) {
+            // race the next address right away, or give up if it was the last
+            close(ep->fd);
+            ep->fd = -1;
+            c->nattempts--;
+            ev_connect_next(c);
+        }
+        else {
+            len = sizeof(peer);
+            if (getpeername(ep->fd, (SA *)&peer, &len) < 0)
+                return;   /* still in progress */
+
+            c->server.fd = ep->fd;
+            ep->fd = -1;
+            ev_drop_attempts(c);
+            if (ev_rewatch(&c->server) < 0) {
+                ev_fail(c);
+                return;
+            }
+            stats_count(STAT_UPSTREAM_NEW, 1);
+            stats_time(STAT_CONNECT, stats_now_us() - c->t_connect);
+            c->state = EV_SEND_REQUEST;
+        }
+    }
+
+    ev_advance(c);
+}
+
+int evloop_run(int listenfd) {
+    struct epoll_event ev, events[EV_MAXEVENTS];
+    int i, n, timeout = -1;
+
+    if ((epfd = epoll_create1(0)) < 0) {
+        fprintf(stderr, "epoll_create1 error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) < 0) {
+        fprintf(stderr, "epoll_ctl error: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // without the pipe, dns_lookup_async() just blocks
+    if ((dns_ep.fd = dns_notify_fd()) >= 0) {
+        ev.data.ptr = &dns_ep;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, dns_ep.fd, &ev);
+    }
+
+    while (1) {
+        if ((n = epoll_wait(epfd, events, EV_MAXEVENTS, timeout)) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "epoll_wait error: %s\n", strerror(errno));
+            return -1;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                ev_accept(listenfd);
+            else if (events[i].data.ptr == &dns_ep)
+                ev_resolved();
+            else
+                ev_handle(events[i].data.ptr, events[i].events);
+        }
+
+        timeout = ev_expire();
+        ev_reap();
+    }
+}
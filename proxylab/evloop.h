@@ -0,0 +1,13 @@
+#ifndef __EVLOOP_H__
+#define __EVLOOP_H__
+
+#define EV_MAXEVENTS 64
+
+/*
+ * evloop_run - Serve every connection accepted on listenfd from a single
+ *     thread, driving each one through parse -> connect -> relay with an
+ *     edge-triggered epoll loop. Never returns unless epoll setup fails.
+ */
+int evloop_run(int listenfd);
+
+#endif /* __EVLOOP_H__ */
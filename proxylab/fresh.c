@@ -0,0 +1,155 @@
+/*
+ * fresh.c - Freshness and validators of responses, per RFC 7234: whether a
+ *     response may be cached, until when it can be served without asking
+ *     the server again, and what to ask with once it cannot.
+ *
+ * Kept apart from csapp.c for the same reason as zcopy.c: strptime() and
+ * timegm() need _GNU_SOURCE.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "fresh.h"
+
+#define FRESH_VALUE_MAX 1024
+
+/* The three HTTP-date formats a recipient has to accept */
+static const char *date_formats[] = {
+    "%a, %d %b %Y %H:%M:%S GMT",    /* IMF-fixdate */
+    "%A, %d-%b-%y %H:%M:%S GMT",    /* RFC 850 */
+    "%a %b %e %H:%M:%S %Y"          /* asctime() */
+};
+
+/* Parse an HTTP-date into *t; returns 0, or -1 if it is not one */
+int fresh_date(const char *s, long *t) {
+    struct tm tm;
+    const char *end;
+    int i;
+
+    for (i = 0; i < sizeof(date_formats) / sizeof(date_formats[0]); i++) {
+        memset(&tm, 0, sizeof(tm));
+        if ((end = strptime(s, date_formats[i], &tm)) != NULL && *end == '\0') {
+            *t = timegm(&tm);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Does directive (up to '=', blank or end) equal name? */
+static int fresh_directive_is(const char *directive, const char *name) {
+    int len = strcspn(directive, "= \t");
+
+    return (int)strlen(name) == len && strncasecmp(directive, name, len) == 0;
+}
+
+/* Number after "name=", quoted or not */
+static long fresh_directive_value(const char *directive) {
+    const char *eq = strchr(directive, '=');
+
+    if (eq == NULL)
+        return -1;
+    eq++;
+    return atol(eq + strspn(eq, " \t\""));
+}
+
+/* Apply one Cache-Control header; value is overwritten */
+static void fresh_cache_control(char *value, Freshness *f, int *no_cache, long *max_age, long *s_maxage) {
+    char *directive, *save;
+
+    for (directive = strtok_r(value, ",", &save); directive != NULL; directive = strtok_r(NULL, ",", &save)) {
+        directive += strspn(directive, " \t");
+
+        if (fresh_directive_is(directive, "no-store") || fresh_directive_is(directive, "private"))
+            f->store = 0;
+        else if (fresh_directive_is(directive, "no-cache"))
+            *no_cache = 1;
+        else if (fresh_directive_is(directive, "must-revalidate") ||
+                fresh_directive_is(directive, "proxy-revalidate"))
+            f->must_revalidate = 1;
+        else if (fresh_directive_is(directive, "max-age"))
+            *max_age = fresh_directive_value(directive);
+        else if (fresh_directive_is(directive, "s-maxage")) {
+            // meant for shared caches like us, and implies proxy-revalidate
+            *s_maxage = fresh_directive_value(directive);
+            f->must_revalidate = 1;
+        }
+    }
+}
+
+/*
+ * fresh_parse - Fill f in from a response head parsed out of buf, as
+ *     received at time now.
+ */
+void fresh_parse(HttpHead *head, const char *buf, long now, Freshness *f) {
+    char value[FRESH_VALUE_MAX];
+    long max_age = -1, s_maxage = -1, expires = -1, modified = -1, date = now, age = 0;
+    long lifetime;
+    int no_cache = 0, pragma_no_cache = 0, has_cache_control = 0;
+    HttpHeader *h;
+    int i;
+
+    f->store = 1;
+    f->must_revalidate = 0;
+    f->etag[0] = f->last_modified[0] = '\0';
+
+    for (i = 0; i < head->nheaders; i++) {
+        h = &head->headers[i];
+        if (http_slice_copy(buf, h->value, value, FRESH_VALUE_MAX) < 0)
+            continue;
+
+        if (http_slice_is(buf, h->name, "Cache-Control")) {
+            has_cache_control = 1;
+            fresh_cache_control(value, f, &no_cache, &max_age, &s_maxage);
+        }
+        else if (http_slice_is(buf, h->name, "Pragma")) {
+            pragma_no_cache = strcasecmp(value, "no-cache") == 0;
+        }
+        else if (http_slice_is(buf, h->name, "Expires")) {
+            // an invalid date, such as "0", means already expired
+            if (fresh_date(value, &expires) < 0)
+                expires = 0;
+        }
+        else if (http_slice_is(buf, h->name, "Date")) {
+            fresh_date(value, &date);
+        }
+        else if (http_slice_is(buf, h->name, "Age")) {
+            age = atol(value);
+        }
+        else if (http_slice_is(buf, h->name, "Last-Modified")) {
+            if (fresh_date(value, &modified) == 0 && h->value.len < FRESH_VALIDATOR_MAX)
+                strcpy(f->last_modified, value);
+        }
+        else if (http_slice_is(buf, h->name, "ETag")) {
+            if (h->value.len < FRESH_VALIDATOR_MAX)
+                strcpy(f->etag, value);
+        }
+    }
+
+    // Pragma only counts for servers that do not speak Cache-Control
+    if (no_cache || (pragma_no_cache && !has_cache_control)) {
+        f->must_revalidate = 1;
+        lifetime = 0;
+    }
+    else if (s_maxage >= 0)
+        lifetime = s_maxage;
+    else if (max_age >= 0)
+        lifetime = max_age;
+    else if (expires >= 0)
+        lifetime = expires > date ? expires - date : 0;
+    else if (modified >= 0 && modified < date)
+        lifetime = (date - modified) / 10 < FRESH_HEURISTIC_MAX ? (date - modified) / 10 : FRESH_HEURISTIC_MAX;
+    else if (head->status == 200)
+        lifetime = FRESH_DEFAULT_TTL;   /* heuristic, RFC 7234 4.2.2 */
+    else
+        lifetime = 0;
+
+    // corrected initial age (RFC 7234, 4.2.3): Age, or time since Date if longer
+    f->received = now;
+    f->age = age > now - date ? age : now - date;
+    if (f->age < 0)
+        f->age = 0;
+    f->expires = now + lifetime - f->age;
+}
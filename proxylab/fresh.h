@@ -0,0 +1,32 @@
+#ifndef __FRESH_H__
+#define __FRESH_H__
+
+#include "httpparse.h"
+
+#define FRESH_VALIDATOR_MAX 256     /* longer ETags and dates are not kept */
+#define FRESH_DEFAULT_TTL 300       /* seconds, for a 200 that says nothing */
+#define FRESH_HEURISTIC_MAX 86400   /* seconds, cap on Last-Modified based lifetimes */
+
+/*
+ * What a response's headers say about caching it. The lifetime comes from
+ * s-maxage, max-age or Expires, in that order; without any of them it is
+ * a tenth of the time since Last-Modified. A 200 that says nothing at all,
+ * like Tiny's, gets FRESH_DEFAULT_TTL: with no validators to revalidate
+ * with, asking the server every time would mean a full fetch on every use.
+ * Other statuses get zero. Age is subtracted, so a response that sat in
+ * another cache is not kept longer than its origin allowed.
+ */
+typedef struct {
+    int store;                  /* no no-store or private */
+    int must_revalidate;        /* no-cache or must-revalidate: never serve stale */
+    long expires;               /* time() from which it is stale */
+    long received;              /* time() it came in */
+    long age;                   /* how old it was then, by Age or Date */
+    char etag[FRESH_VALIDATOR_MAX];             /* "" if none */
+    char last_modified[FRESH_VALIDATOR_MAX];    /* "" if none */
+} Freshness;
+
+int fresh_date(const char *s, long *t);
+void fresh_parse(HttpHead *head, const char *buf, long now, Freshness *f);
+
+#endif /* __FRESH_H__ */
@@ -0,0 +1,49 @@
+#include "hist.h"
+
+#define HIST_SUB (1 << HIST_SUB_BITS)
+
+/* Bucket of a value: linear below HIST_SUB, then HIST_SUB per power of two */
+int hist_bucket(long us) {
+    int msb, idx;
+
+    if (us < HIST_SUB)
+        return us < 0 ? 0 : us;
+
+    msb = 63 - __builtin_clzl(us);
+    idx = ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+        ((us >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+/* Largest value that lands in bucket idx */
+static long hist_bucket_high(int idx) {
+    int shift;
+
+    if (idx < HIST_SUB)
+        return idx;
+
+    shift = (idx >> HIST_SUB_BITS) - 1;
+    return ((long)(HIST_SUB + (idx & (HIST_SUB - 1)) + 1) << shift) - 1;
+}
+
+void hist_record(Hist *h, long us) {
+    if (us < 0)
+        us = 0;
+    h->buckets[hist_bucket(us)]++;
+    h->count++;
+    h->sum += us;
+    if (us > h->max)
+        h->max = us;
+}
+
+/* Smallest recorded value with at least fraction p of the samples at or below it */
+long hist_percentile(Hist *h, double p) {
+    long target = (long)(p * h->count + 0.999999), seen = 0;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        if ((seen += h->buckets[i]) >= target)
+            return hist_bucket_high(i) < h->max ? hist_bucket_high(i) : h->max;
+    }
+    return h->max;
+}
@@ -0,0 +1,24 @@
+#ifndef __HIST_H__
+#define __HIST_H__
+
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS ((40 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+/*
+ * Latency histogram, shared by the proxy's stats page and bench/loadgen.
+ * Buckets are log-linear like HDR histograms: values below 2^HIST_SUB_BITS
+ * get a bucket each, and every power of two above is split into
+ * 2^HIST_SUB_BITS equal buckets, so any value is recorded within about 12%
+ * using a few hundred buckets up to 2^40 us. Not thread safe; stats.c
+ * records into per-thread copies with its own atomic stores.
+ */
+typedef struct {
+    long count, sum, max;
+    long buckets[HIST_BUCKETS];
+} Hist;
+
+int hist_bucket(long us);
+void hist_record(Hist *h, long us);
+long hist_percentile(Hist *h, double p);
+
+#endif /* __HIST_H__ */
@@ -0,0 +1,204 @@
+/*
+ * httpparse.c - Incremental, allocation-free parser for HTTP/1.x message
+ *     heads. It works on the caller's buffer in place (for the proxy, the
+ *     rio buffer), recording slices for the start line and headers, and
+ *     can be called again on the same buffer after each read until the
+ *     blank line ending the head shows up.
+ */
+#include <string.h>
+#include <strings.h>
+#include "httpparse.h"
+
+static HttpSlice http_slice(int off, int len) {
+    HttpSlice s;
+
+    s.off = off;
+    s.len = len;
+    return s;
+}
+
+void http_head_init(HttpHead *head) {
+    head->pos = 0;
+    head->started = 0;
+    head->status = 0;
+    head->nheaders = 0;
+}
+
+/* method SP uri SP version */
+static int http_request_line(HttpHead *head, const char *buf, int off, int end) {
+    const char *sp1, *sp2;
+
+    if ((sp1 = memchr(buf + off, ' ', end - off)) == NULL)
+        return -1;
+    if ((sp2 = memchr(sp1 + 1, ' ', buf + end - (sp1 + 1))) == NULL)
+        return -1;
+
+    head->method = http_slice(off, sp1 - (buf + off));
+    head->uri = http_slice(sp1 + 1 - buf, sp2 - (sp1 + 1));
+    head->version = http_slice(sp2 + 1 - buf, buf + end - (sp2 + 1));
+
+    if (head->method.len == 0 || head->uri.len == 0 ||
+            head->version.len < 8 || strncmp(buf + head->version.off, "HTTP/", 5) != 0)
+        return -1;
+    return 0;
+}
+
+/* version SP 3DIGIT [SP reason] */
+static int http_status_line(HttpHead *head, const char *buf, int off, int end) {
+    const char *sp, *code;
+
+    if ((sp = memchr(buf + off, ' ', end - off)) == NULL)
+        return -1;
+    head->version = http_slice(off, sp - (buf + off));
+
+    code = sp + 1;
+    if (buf + end - code < 3 || strncmp(buf + off, "HTTP/", 5) != 0)
+        return -1;
+    if (code[0] < '0' || code[0] > '9' || code[1] < '0' || code[1] > '9' ||
+            code[2] < '0' || code[2] > '9')
+        return -1;
+
+    head->status = (code[0] - '0') * 100 + (code[1] - '0') * 10 + (code[2] - '0');
+    return 0;
+}
+
+/* name ":" OWS value OWS; folded lines and spaces in names are refused */
+static int http_header_line(HttpHead *head, const char *buf, int off, int end) {
+    const char *colon;
+    HttpHeader *h;
+    int v, e;
+
+    if ((colon = memchr(buf + off, ':', end - off)) == NULL || colon == buf + off)
+        return -1;
+    if (memchr(buf + off, ' ', colon - (buf + off)) != NULL ||
+            memchr(buf + off, '\t', colon - (buf + off)) != NULL)
+        return -1;
+    if (head->nheaders == HTTP_MAX_HEADERS)
+        return -1;
+
+    v = colon + 1 - buf;
+    while (v < end && (buf[v] == ' ' || buf[v] == '\t'))
+        v++;
+    e = end;
+    while (e > v && (buf[e - 1] == ' ' || buf[e - 1] == '\t'))
+        e--;
+
+    h = &head->headers[head->nheaders++];
+    h->name = http_slice(off, colon - (buf + off));
+    h->value = http_slice(v, e - v);
+    return 0;
+}
+
+/*
+ * http_parse - Parse the complete lines of buf[head->pos, len). Returns
+ *     the length of the head once its blank line is in, HTTP_PARSE_MORE,
+ *     or HTTP_PARSE_ERROR.
+ */
+static int http_parse(HttpHead *head, const char *buf, int len, int request) {
+    const char *nl;
+    int off, end, rc;
+
+    while ((nl = memchr(buf + head->pos, '\n', len - head->pos)) != NULL) {
+        off = head->pos;
+        end = nl - buf;
+        head->pos = end + 1;
+        if (end > off && buf[end - 1] == '\r')
+            end--;
+
+        if (end == off) {
+            if (head->started)
+                return head->pos;
+            continue;   /* stray CRLF before the start line */
+        }
+
+        if (!head->started) {
+            head->start = http_slice(off, end - off);
+            if (request)
+                rc = http_request_line(head, buf, off, end);
+            else
+                rc = http_status_line(head, buf, off, end);
+            head->started = 1;
+        }
+        else {
+            rc = http_header_line(head, buf, off, end);
+        }
+
+        if (rc < 0)
+            return HTTP_PARSE_ERROR;
+    }
+
+    return HTTP_PARSE_MORE;
+}
+
+int http_parse_request(HttpHead *head, const char *buf, int len) {
+    return http_parse(head, buf, len, 1);
+}
+
+int http_parse_response(HttpHead *head, const char *buf, int len) {
+    return http_parse(head, buf, len, 0);
+}
+
+/*
+ * http_parse_uri - Split an absolute "http://host[:port][/path]" uri into
+ *     slices. A missing path has length 0. Returns -1 for other uris.
+ */
+int http_parse_uri(const char *buf, HttpSlice uri, HttpUri *parts) {
+    const char *p = buf + uri.off, *end = p + uri.len;
+    const char *host, *slash, *colon, *c;
+
+    if (uri.len < 7 || strncasecmp(p, "http://", 7) != 0)
+        return -1;
+
+    host = p + 7;
+    if ((slash = memchr(host, '/', end - host)) == NULL)
+        slash = end;
+    colon = memchr(host, ':', slash - host);
+
+    parts->host = http_slice(host - buf, (colon != NULL ? colon : slash) - host);
+    if (parts->host.len == 0)
+        return -1;
+
+    parts->port = http_slice(0, 0);
+    if (colon != NULL) {
+        for (c = colon + 1; c < slash; c++) {
+            if (*c < '0' || *c > '9')
+                return -1;
+        }
+        parts->port = http_slice(colon + 1 - buf, slash - (colon + 1));
+    }
+
+    parts->path = http_slice(slash - buf, end - slash);
+    return 0;
+}
+
+/* Case-insensitive comparison of a slice against a string */
+int http_slice_is(const char *buf, HttpSlice s, const char *str) {
+    return (int)strlen(str) == s.len && strncasecmp(buf + s.off, str, s.len) == 0;
+}
+
+/* Case-insensitive suffix test, e.g. "gzip, chunked" ends with "chunked" */
+int http_slice_ends(const char *buf, HttpSlice s, const char *str) {
+    int n = strlen(str);
+
+    return s.len >= n && strncasecmp(buf + s.off + s.len - n, str, n) == 0;
+}
+
+/* Copy a slice out as a string; returns its length, or -1 if it won't fit */
+int http_slice_copy(const char *buf, HttpSlice s, char *dst, int size) {
+    if (s.len >= size)
+        return -1;
+
+    memcpy(dst, buf + s.off, s.len);
+    dst[s.len] = '\0';
+    return s.len;
+}
+
+HttpHeader *http_find_header(HttpHead *head, const char *buf, const char *name) {
+    int i;
+
+    for (i = 0; i < head->nheaders; i++) {
+        if (http_slice_is(buf, head->headers[i].name, name))
+            return &head->headers[i];
+    }
+    return NULL;
+}
@@ -0,0 +1,54 @@
+#ifndef __HTTPPARSE_H__
+#define __HTTPPARSE_H__
+
+#define HTTP_MAX_HEADERS 64
+
+/* http_parse_* results besides the head length */
+#define HTTP_PARSE_MORE 0       /* head not complete yet, read more */
+#define HTTP_PARSE_ERROR -1     /* malformed, or too many headers */
+
+/*
+ * A slice is an offset and length into the buffer being parsed rather than
+ * a pointer, so it stays valid when the caller moves the unread bytes to
+ * the front of its buffer between reads. Nothing is copied or terminated.
+ */
+typedef struct {
+    int off;
+    int len;
+} HttpSlice;
+
+typedef struct {
+    HttpSlice name;     /* without the colon */
+    HttpSlice value;    /* surrounding whitespace trimmed */
+} HttpHeader;
+
+/*
+ * Parse state of one message head. The parser remembers where the first
+ * unparsed line starts, so feeding it the same buffer again after more
+ * bytes arrive only looks at the new lines.
+ */
+typedef struct HttpHeadStruct {
+    int pos;                    /* first line not parsed yet */
+    int started;                /* start line seen */
+    HttpSlice start;            /* whole start line, without CRLF */
+    HttpSlice method, uri;      /* request line */
+    HttpSlice version;          /* both */
+    int status;                 /* status line */
+    int nheaders;
+    HttpHeader headers[HTTP_MAX_HEADERS];
+} HttpHead;
+
+typedef struct {
+    HttpSlice host, port, path;     /* port.len == 0 if absent */
+} HttpUri;
+
+void http_head_init(HttpHead *head);
+int http_parse_request(HttpHead *head, const char *buf, int len);
+int http_parse_response(HttpHead *head, const char *buf, int len);
+int http_parse_uri(const char *buf, HttpSlice uri, HttpUri *parts);
+int http_slice_is(const char *buf, HttpSlice s, const char *str);
+int http_slice_ends(const char *buf, HttpSlice s, const char *str);
+int http_slice_copy(const char *buf, HttpSlice s, char *dst, int size);
+HttpHeader *http_find_header(HttpHead *head, const char *buf, const char *name);
+
+#endif /* __HTTPPARSE_H__ */
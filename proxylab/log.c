@@ -0,0 +1,150 @@
+#include "csapp.h"
+#include "log.h"
+
+typedef struct {
+    int len;
+    char msg[LOG_MSG_MAX];
+} LogRecord;
+
+/*
+ * One thread's messages. Only the owner moves head and only the drain
+ * thread moves tail, so the two never need a lock; the slot between them
+ * is handed over by the release store of head (or tail) and the matching
+ * acquire load on the other side.
+ */
+typedef struct LogRingStruct {
+    unsigned int head;              /* next slot to fill */
+    unsigned int tail;              /* next slot to drain */
+    unsigned long dropped;          /* messages lost to a full ring */
+    struct LogRingStruct *next;     /* all rings, newest first */
+    LogRecord slots[LOG_RING_SLOTS];
+} LogRing;
+
+int log_level = LOG_LV_WARN;
+
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static LogRing *rings;
+static __thread LogRing *my_ring;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;   /* drainer vs log_flush() */
+static sem_t log_wake;
+static int log_sleeping;    /* the drain thread is (about to be) in sem_wait */
+
+/* This thread's ring, registered on first use; threads never exit */
+static LogRing *log_ring(void) {
+    if (my_ring == NULL) {
+        my_ring = Calloc(1, sizeof(LogRing));
+        pthread_mutex_lock(&rings_lock);
+        my_ring->next = rings;
+        __atomic_store_n(&rings, my_ring, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&rings_lock);
+    }
+    return my_ring;
+}
+
+void log_write(const char *fmt, ...) {
+    LogRing *ring = log_ring();
+    unsigned int head = ring->head;
+    LogRecord *rec;
+    va_list ap;
+    int len;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SLOTS) {
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    // format straight into the slot
+    rec = &ring->slots[head & (LOG_RING_SLOTS - 1)];
+    va_start(ap, fmt);
+    len = vsnprintf(rec->msg, LOG_MSG_MAX, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        len = 0;
+    if (len >= LOG_MSG_MAX) {
+        len = LOG_MSG_MAX - 1;
+        rec->msg[len - 1] = '\n';   /* truncated, keep it one line */
+    }
+    rec->len = len;
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+
+    // only pay for sem_post() when the drain thread is asleep
+    if (__atomic_load_n(&log_sleeping, __ATOMIC_SEQ_CST) &&
+            __atomic_exchange_n(&log_sleeping, 0, __ATOMIC_SEQ_CST))
+        sem_post(&log_wake);
+}
+
+/*
+ * log_drain - Copy every pending message to stdout, batching them through
+ *     one buffer. Messages from one thread stay in order; different threads
+ *     interleave by ring. Returns the number of messages written.
+ */
+static int log_drain(void) {
+    char buf[MAXBUF];
+    LogRing *ring;
+    LogRecord *rec;
+    unsigned int head, tail;
+    unsigned long dropped;
+    int used = 0, n = 0;
+
+    pthread_mutex_lock(&drain_lock);
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+
+        for (tail = ring->tail; tail != head; tail++, n++) {
+            rec = &ring->slots[tail & (LOG_RING_SLOTS - 1)];
+            if (used + rec->len > sizeof(buf)) {
+                rio_writen(STDOUT_FILENO, buf, used);
+                used = 0;
+            }
+            memcpy(buf + used, rec->msg, rec->len);
+            used += rec->len;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        if ((dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED)) > 0) {
+            if (used > sizeof(buf) - 64) {
+                rio_writen(STDOUT_FILENO, buf, used);
+                used = 0;
+            }
+            used += sprintf(buf + used, " ! %lu log messages dropped\n", dropped);
+        }
+    }
+
+    if (used > 0)
+        rio_writen(STDOUT_FILENO, buf, used);
+    pthread_mutex_unlock(&drain_lock);
+    return n;
+}
+
+/* Write out what is pending now, e.g. before exit() */
+void log_flush(void) {
+    log_drain();
+}
+
+static void *log_drainer(void *vargp) {
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        if (log_drain() > 0)
+            continue;
+
+        // announce the nap, then look once more so no message slips by
+        __atomic_store_n(&log_sleeping, 1, __ATOMIC_SEQ_CST);
+        if (log_drain() > 0) {
+            __atomic_store_n(&log_sleeping, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        while (sem_wait(&log_wake) < 0 && errno == EINTR)
+            ;
+    }
+    return NULL;
+}
+
+void log_init(int level) {
+    pthread_t tid;
+
+    log_level = level;
+    Sem_init(&log_wake, 0, 0);
+    Pthread_create(&tid, NULL, log_drainer, NULL);
+}
@@ -0,0 +1,42 @@
+#ifndef __LOG_H__
+#define __LOG_H__
+
+/* Levels, most severe first */
+#define LOG_LV_ERROR 0
+#define LOG_LV_WARN 1
+#define LOG_LV_INFO 2
+#define LOG_LV_DEBUG 3
+
+/* Calls above this level are compiled out; set with make LOGLEVEL=n */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LV_INFO
+#endif
+
+#define LOG_RING_SLOTS 128      /* messages buffered per thread, a power of two */
+#define LOG_MSG_MAX 512         /* longer messages are truncated */
+
+/*
+ * Each thread formats its messages into its own single-producer ring,
+ * without locks; a background thread drains all rings to stdout. A full
+ * ring drops the message (and counts it) instead of making a worker wait.
+ * Calls below the runtime level cost one compare, and calls above
+ * LOG_COMPILE_LEVEL are not compiled in at all.
+ */
+extern int log_level;
+
+#define log_at(level, ...) \
+    do { \
+        if ((level) <= LOG_COMPILE_LEVEL && (level) <= log_level) \
+            log_write(__VA_ARGS__); \
+    } while (0)
+
+#define log_error(...) log_at(LOG_LV_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LV_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LV_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_LV_DEBUG, __VA_ARGS__)
+
+void log_init(int level);
+void log_flush(void);
+void log_write(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#endif /* __LOG_H__ */
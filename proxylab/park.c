@@ -0,0 +1,134 @@
+#include <sys/epoll.h>
+#include "csapp.h"
+#include "park.h"
+#include "log.h"
+
+typedef struct ParkedStruct {
+    int fd;
+    long deadline;                          /* park_now_ms() it is closed at */
+    struct ParkedStruct *prev, *next;       /* oldest first */
+} Parked;
+
+static pthread_mutex_t park_lock = PTHREAD_MUTEX_INITIALIZER;
+static Parked *oldest, *newest;
+static int epfd = -1;
+static sbuf_t *ready;       /* woken connections go back here */
+static int idle_timeout;
+
+/* Milliseconds on the monotonic clock */
+static long park_now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* The caller holds park_lock */
+static void park_unlink(Parked *p) {
+    if (p->prev != NULL)
+        p->prev->next = p->next;
+    else
+        oldest = p->next;
+    if (p->next != NULL)
+        p->next->prev = p->prev;
+    else
+        newest = p->prev;
+}
+
+/*
+ * park_expire - Close the connections parked for idle_timeout seconds or
+ *     more. Returns the ms until the next one is due, at most a second.
+ */
+static int park_expire(long now) {
+    Parked *expired = NULL, *p;
+    long wait = 1000;
+
+    pthread_mutex_lock(&park_lock);
+    while ((p = oldest) != NULL && now >= p->deadline) {
+        park_unlink(p);
+        p->next = expired;
+        expired = p;
+    }
+    if (oldest != NULL && oldest->deadline - now < wait)
+        wait = oldest->deadline - now;
+    pthread_mutex_unlock(&park_lock);
+
+    while ((p = expired) != NULL) {
+        expired = p->next;
+        epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+        close(p->fd);
+        Free(p);
+        log_debug(" - Idle connection closed\n");
+    }
+    return wait;
+}
+
+static void *park_poller(void *vargp) {
+    struct epoll_event events[PARK_EVENTS];
+    Parked *p;
+    int i, n, wait = 1000;
+
+    Pthread_detach(pthread_self());
+
+    while (1) {
+        // wake in time to close the oldest idle connection
+        if ((n = epoll_wait(epfd, events, PARK_EVENTS, wait)) < 0)
+            n = 0;
+
+        for (i = 0; i < n; i++) {
+            p = events[i].data.ptr;
+            pthread_mutex_lock(&park_lock);
+            park_unlink(p);
+            pthread_mutex_unlock(&park_lock);
+
+            // a worker's read finds the request, or the close, waiting
+            epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+            sbuf_insert(ready, p->fd);
+            Free(p);
+        }
+
+        wait = park_expire(park_now_ms());
+    }
+    return NULL;
+}
+
+/* Start the poller; woken connections are put on sp */
+void park_init(sbuf_t *sp, int timeout) {
+    pthread_t tid;
+
+    if ((epfd = epoll_create1(0)) < 0)
+        unix_error("epoll_create1 error");
+    ready = sp;
+    idle_timeout = timeout;
+    Pthread_create(&tid, NULL, park_poller, NULL);
+}
+
+/* Hand over fd until its next request arrives */
+void park(int fd) {
+    Parked *p = Malloc(sizeof(Parked));
+    struct epoll_event ev;
+
+    p->fd = fd;
+    p->deadline = park_now_ms() + idle_timeout * 1000L;
+
+    // listed and watched under the lock, so the poller neither wakes nor
+    // expires it half parked
+    pthread_mutex_lock(&park_lock);
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = p;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        pthread_mutex_unlock(&park_lock);
+        log_error("park error: %s\n", strerror(errno));
+        close(fd);
+        Free(p);
+        return;
+    }
+    p->prev = newest;
+    p->next = NULL;
+    if (newest != NULL)
+        newest->next = p;
+    else
+        oldest = p;
+    newest = p;
+    pthread_mutex_unlock(&park_lock);
+}
@@ -0,0 +1,19 @@
+#ifndef __PARK_H__
+#define __PARK_H__
+
+#include "sbuf.h"
+
+#define PARK_EVENTS 64      /* wakeups handled per epoll_wait() */
+
+/*
+ * Idle persistent client connections wait here between requests instead
+ * of in a worker's read(). A poller thread watches them with epoll and
+ * puts each one back on the worker queue as soon as its next request (or
+ * its close) arrives, and closes those idle for timeout seconds. So a few
+ * browsers holding many idle connections cannot starve new ones of
+ * workers. Only connections with nothing buffered may be parked.
+ */
+void park_init(sbuf_t *sp, int timeout);
+void park(int fd);
+
+#endif /* __PARK_H__ */
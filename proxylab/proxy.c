@@ -1,286 +1,1075 @@
 #include <stdio.h>
-#include "csapp.h"
-#include "cache.h"
+#include <limits.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+#include "proxy.h"
+#include "evloop.h"
+#include "sbuf.h"
+#include "park.h"
+#include "zcopy.h"
+#include "upstream.h"
+#include "dns.h"
+#include "log.h"
+#include "stats.h"
+#include "cachesim.h"
 
 /* Recommended max cache and object sizes */
 #define NUM_HEADERS 100
 #define MAXRESPONSE (1<<20) // 1 MB
 
-int parse_uri(char *uri, char *shost, char *sport, char *spath);
-void *proxy(void *vargp);
+/* Default worker pool size and connection queue depth */
+#define NTHREADS 16
+#define SBUFSIZE 64
+
+/* Seconds a persistent client may sit idle between requests */
+#define CLIENT_TIMEOUT 5
+
+/* ms a worker waits for the next request before parking the connection */
+#define CLIENT_LINGER 2
+
+/* Requests a worker answers in a row on one connection before parking it */
+#define CLIENT_TURN 16
+
+/* Default seconds between cache snapshots */
+#define SNAPSHOT_INTERVAL 60
+
+/* Largest rewritten request head we will send upstream */
+#define MAXREQUEST (4 * MAXBUF)
+
+/* Pieces of a relayed response head: start line, headers, our own lines */
+#define MAXHEADIOV (2 * HTTP_MAX_HEADERS + 8)
+
+/* Client If-None-Match/If-Modified-Since headers held back per request */
+#define MAXCOND 4
+
+/* redir_back outcomes */
+#define RELAY_NO_RESPONSE -2    /* server closed before sending anything */
+#define RELAY_ERROR -1          /* relay failed part way */
+#define RELAY_DONE 0            /* relayed, server connection not reusable */
+#define RELAY_KEEP 1            /* relayed, server connection can be pooled */
+
+/*
+ * Per-connection request state. Each worker owns exactly one and reuses it
+ * for every connection it serves, so nothing here is shared between threads.
+ */
+typedef struct {
+    int connfd;                 /* client socket */
+    rio_t rioclient;            /* buffered reader over connfd */
+    HttpHead head;              /* client request head, slices of rioclient */
+    HttpHead response_head;     /* server response head, slices of its rio */
+    char shost[MAXLINE];        /* parsed from uri */
+    char sport[MAXLINE];
+    char spath[MAXLINE];
+    char uri2[MAXLINE];         /* normalized cache key: host:port/path */
+    char request[MAXREQUEST];   /* rewritten request head for the server */
+    int request_len;
+    int client_http11;          /* client spoke HTTP/1.1 */
+    int client_keep;            /* keep the client connection after this response */
+    int leader;                 /* fetching uri2 for others, see cache_search_flight() */
+    int cond[MAXCOND];          /* head->headers indices of the client's If-* headers */
+    int ncond;
+    CacheNode *stale;           /* pinned expired entry being revalidated, or NULL */
+    int revalidated;            /* the server answered 304 for stale */
+    int store_fd;               /* file store copy of the body being fetched, or -1 */
+    int pipefd[2];              /* splice() pipe, created on first use */
+    long t_start;               /* us, request head complete */
+    long t_sent;                /* us, request written to the server */
+} ProxyConn;
+
+void *worker(void *vargp);
+void *snapshotter(void *vargp);
+void proxy(ProxyConn *conn);
+int proxy_request(ProxyConn *conn);
 void close_proxy(int connfd);
-void redir_back(int connfd, int clientfd, rio_t *rioclientp, rio_t *rioserverp, char *uri2);
+int redir_back(ProxyConn *conn, int clientfd, rio_t *rioserverp);
+static int request_append(ProxyConn *conn, char *data, int len);
+static int serve_stats(ProxyConn *conn, int head_len);
+static int serve_cached(ProxyConn *conn, CacheNode *node);
+static int send_error(ProxyConn *conn, int status, const char *reason);
+static void flight_land(ProxyConn *conn);
+static int read_head(rio_t *rp, HttpHead *head, int request);
+static void iov_push(struct iovec *iov, int *iovcnt, char *data, int len);
 void sigchld_handler(int sig);
 
-// pthread_rwlock_t lock;
-pthread_mutex_t mutex;
-rio_t rioclient;
-int nread;
-char buf[MAXLINE];
-
-CacheList *cache;
+Cache *cache;
+sbuf_t sbuf;    // accepted connections waiting for a worker
+int zerocopy;   // splice() uncached bodies instead of copying them
+int upstream_keepalive = 1;     // speak HTTP/1.1 keep-alive to servers
+int client_timeout = CLIENT_TIMEOUT;
+char *snapshot_path;    // where the cache is saved, or NULL
+int snapshot_interval = SNAPSHOT_INTERVAL;
+sigset_t snapshot_signals;  // handled by the snapshotter only
 
 /* You won't lose style points for including this long line in your code */
 // static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 char header_connection[MAXLINE] = "Connection: close\r\n";
+char header_keepalive[] = "Connection: keep-alive\r\n";
 
 int main(int argc, char *argv[])
 {
-    int listenfd, *connfdp;
+    int listenfd, connfd, opt, i, nodelay = 1;
+    int use_epoll = 0;
+    int admission = 0;
+    int nthreads = NTHREADS;
+    int sbufsize = SBUFSIZE;
+    char *store_dir = NULL;
+    char *hosts_file = NULL;
+    char *trace = NULL;
+    long store_size = 0;
+    int policy = CACHE_LRU;
+    int max_idle = UPSTREAM_MAX_IDLE;
+    int idle_timeout = UPSTREAM_IDLE_TIMEOUT;
+    int connect_ms = UPSTREAM_CONNECT_TIMEOUT;
+    int verbosity = LOG_LV_WARN;
     socklen_t clientlen;
     struct sockaddr_in clientaddr;
+    struct timeval timeout;
+    pthread_t tid;
+
+    while ((opt = getopt(argc, argv, "ac:d:D:ef:F:H:k:K:n:P:q:s:t:vz")) != -1) {
+        switch (opt) {
+        case 'a':   // only cache objects seen more often than what they evict
+            admission = 1;
+            break;
+        case 'c':   // ms allowed to connect to a server
+            connect_ms = atoi(optarg);
+            break;
+        case 'd':   // save the cache here and reload it at startup
+            snapshot_path = optarg;
+            break;
+        case 'D':   // seconds between snapshots
+            snapshot_interval = atoi(optarg);
+            break;
+        case 'e':   // single-threaded epoll event loop
+            use_epoll = 1;
+            break;
+        case 'f':   // keep cached bodies in files under this directory
+            store_dir = optarg;
+            break;
+        case 'F':   // byte budget of the file store
+            store_size = atol(optarg);
+            break;
+        case 'H':   // answer these names from a hosts file
+            hosts_file = optarg;
+            break;
+        case 'k':   // idle server connections kept per origin, 0 disables
+            max_idle = atoi(optarg);
+            break;
+        case 'K':   // seconds an idle server connection is kept
+            idle_timeout = atoi(optarg);
+            break;
+        case 'n':   // worker threads
+            nthreads = atoi(optarg);
+            break;
+        case 'P':   // eviction policy: lru, clock, s3fifo or lfu
+            if ((policy = cache_policy(optarg)) < 0) {
+                printf("Unknown eviction policy: %s\n", optarg);
+                return -1;
+            }
+            break;
+        case 'q':   // connection queue depth
+            sbufsize = atoi(optarg);
+            break;
+        case 's':   // replay an access trace under each policy and exit
+            trace = optarg;
+            break;
+        case 't':   // seconds a persistent client may stay idle
+            client_timeout = atoi(optarg);
+            break;
+        case 'v':   // log more, -v for info and -vv for debug
+            verbosity++;
+            break;
+        case 'z':   // zero-copy relay of uncached bodies
+            zerocopy = 1;
+            break;
+        default:
+            printf("usage: %s [-a] [-c ms] [-d file [-D secs]] [-e] [-f dir [-F bytes]] [-H hosts] [-k idle [-K secs]] [-n threads] [-P policy] [-q queue] [-t secs] [-v] [-z] <port>\n"
+                   "       %s -s trace [-F bytes]\n", argv[0], argv[0]);
+            return -1;
+        }
+    }
+
+    // simulate with the -F budget, or the heap cache's
+    if (trace != NULL)
+        return cachesim_run(trace, store_size > 0 ? store_size : MAX_CACHE_SIZE) < 0 ? -1 : 0;
+
+    if (nthreads < 1 || sbufsize < 1) {
+        printf("Worker count and queue depth must be positive\n");
+        return -1;
+    }
+    if (client_timeout < 1) {
+        printf("Client timeout must be positive\n");
+        return -1;
+    }
+    if (snapshot_interval < 1) {
+        printf("Snapshot interval must be positive\n");
+        return -1;
+    }
 
     // ignore sigpipes
     signal(SIGPIPE, SIG_IGN);
 
-    // initialize reader/writer lock for cache
-    // pthread_rwlock_init(&lock, NULL);
+    // with snapshots, SIGINT and SIGTERM mean save and exit; block them
+    // before any thread starts so that only the snapshotter sees them
+    if (snapshot_path != NULL) {
+        sigemptyset(&snapshot_signals);
+        sigaddset(&snapshot_signals, SIGINT);
+        sigaddset(&snapshot_signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &snapshot_signals, NULL);
+    }
 
-    if (!argv[1]){
+    if (optind >= argc) {
         printf("Missing command line port number\n");
         return -1;
     }
 
     // init proxy server
+    log_init(verbosity);
+    stats_init();
     Signal(SIGCHLD, sigchld_handler);
-    listenfd = Open_listenfd(argv[1]);
+    listenfd = Open_listenfd(argv[optind]);
+
+    // init resolver cache
+    dns_init(hosts_file);
+
+    // init server connection pool
+    upstream_init(max_idle, idle_timeout, connect_ms);
+    upstream_keepalive = max_idle > 0;
 
     // init cache
-    pthread_mutex_init(&mutex, NULL);
-    cache = Malloc(sizeof(CacheList));
-    cache_init(cache);
+    cache = Malloc(sizeof(Cache));
+    if (store_dir == NULL)
+        cache_init(cache, MAX_CACHE_SIZE, NULL, policy);
+    else
+        cache_init(cache, store_size > 0 ? store_size : CACHE_STORE_SIZE, store_dir, policy);
+    cache->admission = admission;
+
+    // warm up from the last snapshot, then keep saving
+    if (snapshot_path != NULL) {
+        long t = stats_now_us();
+        int loaded = cache_load(cache, snapshot_path);
+
+        if (loaded >= 0)
+            fprintf(stderr, "* Loaded %d cached objects from %s in %ld ms\n", loaded, snapshot_path,
+                    (stats_now_us() - t) / 1000);
+        Pthread_create(&tid, NULL, snapshotter, NULL);
+    }
 
     // start listening
     if (listenfd < 0) {
         printf("open_listenfd failed.\n");
     }
+    else if (use_epoll) {
+        printf("* Serving on port: %s (epoll)\n", argv[optind]);
+        evloop_run(listenfd);
+    }
     else {
-        printf("* Serving on port: %s\n", argv[1]);
+        printf("* Serving on port: %s (%d workers)\n", argv[optind], nthreads);
+
+        // prethread the worker pool; idle clients wait in the park
+        sbuf_init(&sbuf, sbufsize);
+        park_init(&sbuf, client_timeout);
+        for (i = 0; i < nthreads; i++)
+            Pthread_create(&tid, NULL, worker, NULL);
+
+        timeout.tv_sec = client_timeout;
+        timeout.tv_usec = 0;
 
         while (1) {
             clientlen = sizeof(clientaddr);
-            connfdp = Malloc(sizeof(int));
-            *connfdp = Accept(listenfd, (struct sockaddr *)&clientaddr, &clientlen);
+            connfd = accept(listenfd, (struct sockaddr *)&clientaddr, &clientlen);
 
-            // serve
-            if (*connfdp < 0) {
-                printf("Accept failed.\n");
+            // serve (blocks while the queue is full)
+            if (connfd < 0) {
+                log_error("Accept failed: %s\n", strerror(errno));
             }
             else {
-                pthread_t tid;
-                pthread_create(&tid, NULL, proxy, (void *)connfdp);
+                // a client that stalls mid-request must not hold a worker forever
+                setsockopt(connfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+                // a response head and its body are separate writes; Nagle would
+                // hold the body back until the client's delayed ACK of the head
+                setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+                sbuf_insert(&sbuf, connfd);
             }
         }
     }
 
     // stop proxy server
     Close(listenfd);
-    // pthread_rwlock_destroy(&lock);
     return 0;
 }
 
-int parse_uri(char *uri, char *shost, char *sport, char *spath) {
-    char *cur = uri;
-    
-    if (strncmp(uri, "http://", 7) != 0)
-        return -1;
+/*
+ * error_page - A complete response of our own for a request we refuse,
+ *     with the reason as its body and Connection: close. Returns a
+ *     Malloc'd buffer of *len bytes.
+ */
+char *error_page(int status, const char *reason, int *len) {
+    char *page = Malloc(2 * strlen(reason) + strlen(header_connection) + 128);
 
-    cur += 7;
-    char *cpy = shost;
-    strncpy(sport, "80\0", 3);
-    strncpy(spath, "/\0", 2);
+    *len = sprintf(page, "HTTP/1.0 %d %s\r\nContent-type: text/plain\r\nContent-length: %d\r\n%s\r\n%s\n",
+            status, reason, (int)strlen(reason) + 1, header_connection, reason);
+    return page;
+}
 
-    while (*cur != '\0') {
-        if (*cur == '/') {
-            *cpy = '\0';
-            cpy = spath;
-        }
-        else if (*cur == ':') {
-            cur++;
-            *cpy = '\0';
-            cpy = sport;
-        }
+/*
+ * host_header - Write the Host line for a request that came without one
+ *     into buf, which must hold strlen(shost) + strlen(sport) + 10 bytes.
+ *     The default port is left out. Returns the line's length.
+ */
+int host_header(char *buf, const char *shost, const char *sport) {
+    if (strcmp(sport, "80") == 0)
+        return sprintf(buf, "Host: %s\r\n", shost);
+    return sprintf(buf, "Host: %s:%s\r\n", shost, sport);
+}
+
+/*
+ * snapshotter - Save the cache to snapshot_path every snapshot_interval
+ *     seconds, and once more on SIGINT or SIGTERM before exiting, so that
+ *     a restarted proxy starts with a warm cache.
+ */
+void *snapshotter(void *vargp) {
+    struct timespec interval = { snapshot_interval, 0 };
+    int sig, saved;
 
-        *cpy = *cur;
-        cur++;
-        cpy++;
+    Pthread_detach(pthread_self());
+    while (1) {
+        if ((sig = sigtimedwait(&snapshot_signals, NULL, &interval)) < 0 && errno == EINTR)
+            continue;
+
+        if ((saved = cache_save(cache, snapshot_path)) < 0)
+            log_warn(" - Could not save cache snapshot to %s: %s\n", snapshot_path, strerror(errno));
+        else
+            log_info(" * Saved %d cached objects to %s\n", saved, snapshot_path);
+
+        if (sig > 0) {
+            log_flush();
+            fprintf(stderr, "* Exiting on signal %d, %d cached objects saved\n", sig, saved);
+            exit(0);
+        }
     }
+    return NULL;
+}
+
+/*
+ * parse_uri - Split the absolute uri slice of buf into host, port and path
+ *     strings, defaulting to port 80 and path "/". Returns -1 if it is not
+ *     an http uri or a part does not fit in MAXLINE.
+ */
+int parse_uri(const char *buf, HttpSlice uri, char *shost, char *sport, char *spath) {
+    HttpUri parts;
 
-    *cpy = '\0';
+    if (http_parse_uri(buf, uri, &parts) < 0 ||
+            http_slice_copy(buf, parts.host, shost, MAXLINE) < 0)
+        return -1;
+
+    if (parts.port.len == 0)
+        strcpy(sport, "80");
+    else if (http_slice_copy(buf, parts.port, sport, MAXLINE) < 0)
+        return -1;
+
+    if (parts.path.len == 0)
+        strcpy(spath, "/");
+    else if (http_slice_copy(buf, parts.path, spath, MAXLINE) < 0)
+        return -1;
 
     return 0;
 }
 
-void *proxy(void *vargp) {
-    int connfd = *(int*)vargp;
-    pthread_detach(pthread_self());
-    Free(vargp);
+void *worker(void *vargp) {
+    ProxyConn *conn = Malloc(sizeof(ProxyConn));
+    conn->pipefd[0] = conn->pipefd[1] = -1;
+    conn->store_fd = -1;
+    Pthread_detach(pthread_self());
 
-    printf(" * Connection accepted...\n");
+    while (1) {
+        conn->connfd = sbuf_remove(&sbuf);
+        proxy(conn);
+    }
+}
+
+/*
+ * proxy - Serve a client connection that has something to read. Requests
+ *     are answered in order while they keep coming, pipelined ones simply
+ *     waiting in rioclient until their turn. Once nothing is buffered, the
+ *     connection is parked until its next request rather than waited on
+ *     here, unless that arrives within CLIENT_LINGER ms. It is parked
+ *     anyway once it has had CLIENT_TURN requests or other connections
+ *     are waiting for a worker, so busy clients take turns instead of
+ *     holding on to workers. It is closed when the client asks to close or
+ *     a response cannot be delimited.
+ */
+void proxy(ProxyConn *conn) {
+    struct pollfd pfd = { conn->connfd, POLLIN, 0 };
+    int served = 0;
+
+    log_debug(" * Connection ready...\n");
 
     // init buffered i/o for connfd
-    rio_readinitb(&rioclient, connfd);
+    rio_readinitb(&conn->rioclient, conn->connfd);
+
+    do {
+        if (!proxy_request(conn)) {
+            close_proxy(conn->connfd);
+            log_debug(" - Connection closed after %d request(s)\n", served);
+            return;
+        }
+        served++;
+    } while (conn->rioclient.rio_cnt > 0 ||
+            (served < CLIENT_TURN && sbuf_waiting(&sbuf) == 0 && poll(&pfd, 1, CLIENT_LINGER) > 0));
+
+    park(conn->connfd);
+}
 
-    // request line
-    char crequest[MAXLINE];
-    nread = rio_readlineb(&rioclient, crequest, MAXLINE);
-    printf("c> %s", crequest);
+/*
+ * proxy_request - Read one request from the client and answer it, from the
+ *     cache or the server. Returns 1 if the client connection can carry
+ *     another request, 0 if it must be closed.
+ */
+int proxy_request(ProxyConn *conn) {
+    char *shost = conn->shost, *sport = conn->sport, *spath = conn->spath;
+    rio_t *rp = &conn->rioclient;
+    HttpHead *head = &conn->head;
+    HttpHeader *h;
+    char *buf;
+    int head_len, i;
 
-    // parse client request
-    char method[MAXLINE];
-    char uri[MAXLINE];
-    char uri2[MAXLINE];
-    char http_version[MAXLINE];
-    sscanf(crequest, "%s %s %s", method, uri, http_version);
+    // request head, parsed in place in the rio buffer
+    if ((head_len = read_head(rp, head, 1)) <= 0) {
+        if (head_len < 0)
+            log_info(" - Malformed or oversized request\n");
+        return 0;
+    }
+    conn->t_start = stats_now_us();
+    buf = rp->rio_bufptr;
+    log_debug("c> %.*s", head_len, buf);
 
     // check client method
-    if (strcmp(method, "GET") != 0) {
-        printf(" - Unsupported method: %s\n", method);
-        close_proxy(connfd);
-        return NULL;
+    if (!http_slice_is(buf, head->method, "GET")) {
+        log_info(" - Unsupported method: %.*s\n", head->method.len, buf + head->method.off);
+        return 0;
     }
 
     // parse client uri
-    char shost[MAXLINE];
-    char sport[MAXLINE];
-    char spath[MAXLINE];
-    if (parse_uri(uri, shost, sport, spath) < 0) {
-        printf(" - Error parsing URI\n");
-        close_proxy(connfd);
-        return NULL;
+    if (parse_uri(buf, head->uri, shost, sport, spath) < 0) {
+        log_info(" - Error parsing URI\n");
+        return send_error(conn, 400, "Bad Request");
+    }
+
+    log_debug(" | shost: %s, sport: %s, spath: %s\n", shost, sport, spath);
+
+    // HTTP/1.1 clients persist by default, HTTP/1.0 ones must ask
+    conn->client_http11 = http_slice_is(buf, head->version, "HTTP/1.1");
+    conn->client_keep = conn->client_http11;
+
+    // our own page, answered without going near the cache or a server
+    if (strcasecmp(shost, STATS_HOST) == 0)
+        return serve_stats(conn, head_len);
+    stats_count(STAT_REQUESTS, 1);
+
+    // rewrite the rest of the client request for the server
+    char header[2 * MAXLINE + 16];  // fits "Host: host:port" for any parsed host and port
+    int has_host = 0;
+    int keepalive = upstream_keepalive;
+
+    conn->request_len = snprintf(conn->request, MAXREQUEST, "GET %s HTTP/1.%d\r\n", spath, keepalive);
+    conn->ncond = 0;
+    log_debug(" | proxy_request: %s", conn->request);
+
+    for (i = 0; i < head->nheaders; i++) {
+        h = &head->headers[i];
+
+        // hop-by-hop Connection/Proxy-Connection/Keep-Alive headers are ours
+        if (http_slice_is(buf, h->name, "Connection") ||
+                http_slice_is(buf, h->name, "Proxy-Connection")) {
+            if (http_slice_is(buf, h->value, "close"))
+                conn->client_keep = 0;
+            else if (http_slice_is(buf, h->value, "keep-alive"))
+                conn->client_keep = 1;
+            continue;
+        }
+        if (http_slice_is(buf, h->name, "Keep-Alive"))
+            continue;
+
+        if (http_slice_is(buf, h->name, "Host"))
+            has_host = 1;
+
+        // the client's validators only go out if we have none of our own
+        if ((http_slice_is(buf, h->name, "If-None-Match") ||
+                http_slice_is(buf, h->name, "If-Modified-Since")) && conn->ncond < MAXCOND) {
+            conn->cond[conn->ncond++] = i;
+            continue;
+        }
+
+        // the raw "name: value" bytes, as the client sent them
+        if (request_append(conn, buf + h->name.off, h->value.off + h->value.len - h->name.off) < 0 ||
+                request_append(conn, "\r\n", 2) < 0) {
+            log_info(" - Oversized request\n");
+            return 0;
+        }
+    }
+
+    // done with the head; pipelined requests stay buffered behind it
+    rp->rio_bufptr += head_len;
+    rp->rio_cnt -= head_len;
+    stats_time(STAT_PARSE, stats_now_us() - conn->t_start);
+    log_debug(" + End of client request\n");
+
+    // serve from cache, if possible; concurrent misses wait for one fetch
+    if (snprintf(conn->uri2, MAXLINE, "%s:%s%s", shost, sport, spath) >= MAXLINE) {
+        // a truncated key could name some other object
+        log_info(" - URI too long for a cache key\n");
+        return send_error(conn, 414, "URI Too Long");
+    }
+    CacheNode *node;
+    int waited;
+    node = cache_search_flight(cache, conn->uri2, &conn->leader, &waited);
+    if (waited)
+        stats_count(STAT_COALESCED, 1);
+    if (node != NULL && cache_fresh(node)) {
+        stats_count(STAT_HITS, 1);
+        return serve_cached(conn, node);
+    }
+    stats_count(STAT_MISSES, 1);
+
+    // an expired entry asks with its own validators, then a 304 lets us send it
+    conn->stale = node;
+    conn->revalidated = 0;
+    if (node != NULL) {
+        stats_count(STAT_STALE, 1);
+        log_debug(" + Revalidating cached copy\n");
+        if (node->etag != NULL) {
+            snprintf(header, sizeof(header), "If-None-Match: %s\r\n", node->etag);
+            request_append(conn, header, -1);
+        }
+        if (node->last_modified != NULL) {
+            snprintf(header, sizeof(header), "If-Modified-Since: %s\r\n", node->last_modified);
+            request_append(conn, header, -1);
+        }
     }
     else {
-        // serve from cache, if possible
-
-        // debugging
-        printf(" | shost: %s\n", shost);
-        printf(" | sport: %s\n", sport);
-        printf(" | spath: %s\n", spath);
-
-        sprintf(uri2, "%s:%s%s", shost, sport, spath);
-        CacheNode *node;
-        if ((node = cache_search(cache, uri2)) != NULL) {
-            printf(" + Content found in cache...\n");
-            printf(" | node->content_len: %d\n", node->content_len);
-            cache_renew(cache, node);
-            printf(" | after cache_renew()... |");
-            char content_headers[MAXLINE];
-            sprintf(content_headers,   "HTTP/1.0 200 OK\r\n");
-            sprintf(content_headers, "%sConnection: close\r\n", content_headers);
-            sprintf(content_headers, "%sContent-length: %d\r\n", content_headers, node->content_len);
-            sprintf(content_headers, "%sContent-type: %s\r\n\r\n", content_headers, node->content_type);
-            printf(" | content_headers:\n");
-            printf("============================\n");
-            printf("%s\n", content_headers);
-            printf("============================\n");
-            Rio_writen(connfd, content_headers, strlen(content_headers));
-            Rio_writen(connfd, node->content, node->content_len);
-            close_proxy(connfd);
-            printf(" - Connection closed (served from cache)\n");
-            return NULL;
+        for (i = 0; i < conn->ncond; i++) {
+            h = &head->headers[conn->cond[i]];
+            request_append(conn, buf + h->name.off, h->value.off + h->value.len - h->name.off);
+            request_append(conn, "\r\n", 2);
+        }
+    }
+
+    // end proxy request
+    if (!has_host)
+        request_append(conn, header, host_header(header, shost, sport));
+    if (request_append(conn, keepalive ? header_keepalive : header_connection, -1) < 0 ||
+            request_append(conn, "\r\n", 2) < 0) {
+        flight_land(conn);
+        if (conn->stale != NULL) {
+            cache_release(conn->stale);
+            conn->stale = NULL;
         }
+        return 0;
     }
 
-    // connect to server
-    int clientfd = Open_clientfd(shost, sport);
-    rio_t rioserver;
-    rio_readinitb(&rioserver, clientfd);
-
-    // build proxy request
-    char proxy_request[MAXLINE];
-    sprintf(proxy_request, "GET %s HTTP/1.0\r\n", spath);
-    printf(" | proxy_request: %s", proxy_request);
-    rio_writen(clientfd, proxy_request, strlen(proxy_request));
-
-    // redirect headers
-    char header[MAXLINE];
-    char headname[MAXLINE];
-    char headval[MAXLINE];
-
-    if (nread != 0)
-    while ((nread = rio_readlineb(&rioclient, header, MAXLINE)) != 0) {
-        printf("c> %s", header);
-
-        // ignore Connection/Proxy-Connection headers
-        sscanf(header, "%s %s", headname, headval);
-        if (strcmp(headname, "Proxy-Connection:") != 0 &&
-                strcmp(headname, "Connection:") != 0 &&
-                strcmp(header, "\r\n") != 0) {
-            rio_writen(clientfd, header, strlen(header));
+    // send it, retrying once on a fresh connection if a pooled one went stale
+    int attempt, reused, rc = RELAY_ERROR;
+    for (attempt = 0; attempt < 2; attempt++) {
+        long t_connect = stats_now_us();
+        int clientfd = upstream_get(shost, sport, &reused);
+        if (clientfd < 0) {
+            log_warn(" - Could not connect to %s:%s\n", shost, sport);
+            break;
+        }
+        if (reused) {
+            stats_count(STAT_UPSTREAM_REUSED, 1);
+        }
+        else {
+            stats_count(STAT_UPSTREAM_NEW, 1);
+            stats_time(STAT_CONNECT, stats_now_us() - t_connect);
         }
 
-        // end of headers
-        if (strcmp(header, "\r\n") == 0) {
-            printf(" + End of client request\n");
+        rio_t rioserver;
+        rio_readinitb(&rioserver, clientfd);
 
-            // end proxy request
-            rio_writen(clientfd, header_connection, strlen(header_connection));
-            rio_writen(clientfd, "\r\n", 2);
-            // redir response back
-            redir_back(connfd, clientfd, &rioclient, &rioserver, uri2);
+        if (rio_writen(clientfd, conn->request, conn->request_len) < 0) {
+            rc = RELAY_NO_RESPONSE;
+        }
+        else {
+            conn->t_sent = stats_now_us();
+            rc = redir_back(conn, clientfd, &rioserver);
+        }
 
-            printf(" + Redirection complete!\n");
+        if (rc == RELAY_KEEP)
+            upstream_put(shost, sport, clientfd);
+        else
+            Close(clientfd);
+
+        if (rc != RELAY_NO_RESPONSE || !reused)
             break;
+        log_info(" * Pooled connection went stale, retrying\n");
+    }
+    flight_land(conn);
+
+    // nothing has gone to the client yet: answer from the entry if we may
+    if ((node = conn->stale) != NULL) {
+        conn->stale = NULL;
+        if (conn->revalidated)
+            return serve_cached(conn, node);
+        if (!node->must_revalidate) {
+            log_info(" * Server unavailable, serving stale copy of %s\n", conn->uri2);
+            return serve_cached(conn, node);
         }
+        cache_release(node);
     }
 
-    Close(clientfd);
-    close_proxy(connfd);
-    printf(" - Connection closed\n");
+    if (rc < RELAY_DONE) {
+        stats_count(STAT_ERRORS, 1);
+        return 0;
+    }
 
-    return NULL;
+    stats_time(STAT_TOTAL, stats_now_us() - conn->t_start);
+    log_debug(" + Redirection complete!\n");
+    return conn->client_keep;
+}
+
+/*
+ * serve_stats - Answer a request for STATS_HOST from stats_page() and
+ *     consume its head. Same return value as proxy_request.
+ */
+static int serve_stats(ProxyConn *conn, int head_len) {
+    char *page;
+    int len, rc;
+
+    page = stats_page(conn->spath, conn->client_keep ? header_keepalive : header_connection, &len);
+    rc = rio_writen(conn->connfd, page, len);
+    Free(page);
+
+    conn->rioclient.rio_bufptr += head_len;
+    conn->rioclient.rio_cnt -= head_len;
+    return rc == len && conn->client_keep;
+}
+
+/*
+ * serve_cached - Send a pinned cache entry to the client and release it.
+ *     Same return value as proxy_request.
+ */
+static int serve_cached(ProxyConn *conn, CacheNode *node) {
+    char *connection = conn->client_keep ? header_keepalive : header_connection;
+    char age[32];
+    struct iovec iov[5];
+    int iovcnt = 0, rc;
+    ssize_t sent;
+
+    log_debug(" + Content found in cache (%d bytes)\n", node->content_len);
+
+    // stored header block, Age, Connection, blank line and a heap body in one go
+    iov_push(iov, &iovcnt, node->header, node->header_len);
+    iov_push(iov, &iovcnt, age, sprintf(age, "Age: %ld\r\n", cache_age(node)));
+    iov_push(iov, &iovcnt, connection, strlen(connection));
+    iov_push(iov, &iovcnt, "\r\n", 2);
+    if (node->fd < 0)
+        iov_push(iov, &iovcnt, node->content, node->content_len);
+
+    rc = (sent = rio_writev(conn->connfd, iov, iovcnt)) < 0 ? -1 : 0;
+    if (rc == 0 && node->fd >= 0) {
+        long offset = 0;
+        rc = zc_sendfile(conn->connfd, node->fd, &offset, node->content_len);
+        sent += offset;
+    }
+
+    log_info(" = access %s %d 200\n", conn->uri2, node->content_len);
+    cache_release(node);
+    if (rc == 0) {
+        stats_count(STAT_BYTES_CACHE, sent);
+        stats_time(STAT_TOTAL, stats_now_us() - conn->t_start);
+    }
+    else {
+        stats_count(STAT_ERRORS, 1);
+    }
+    log_debug(" + Served from cache\n");
+    return rc == 0 && conn->client_keep;
+}
+
+/* Refuse the request with an error page; the connection is closed after */
+static int send_error(ProxyConn *conn, int status, const char *reason) {
+    int len;
+    char *page = error_page(status, reason, &len);
+
+    rio_writen(conn->connfd, page, len);
+    Free(page);
+    return 0;
+}
+
+/* Let requests waiting on our fetch look in the cache again */
+static void flight_land(ProxyConn *conn) {
+    if (conn->leader) {
+        cache_land(cache, conn->uri2);
+        conn->leader = 0;
+    }
 }
 
 void close_proxy(int connfd) {
     Close(connfd);
 }
 
-void redir_back(int connfd, int clientfd, rio_t *rioclientp, rio_t *rioserverp, char *uri2) {
-    printf(" * Redirecting back...\n");
-
-    char header[MAXLINE];
-    char headname[MAXLINE];
-    char headval[MAXLINE];
-    char content_type[MAXLINE];
-    char content[MAX_OBJECT_SIZE];
-    int content_len = 0;
+/*
+ * request_append - Append len bytes (strlen(data) if len < 0) to the
+ *     rewritten request head. Returns -1 if it would not fit.
+ */
+static int request_append(ProxyConn *conn, char *data, int len) {
+    if (len < 0)
+        len = strlen(data);
+    if (conn->request_len + len > MAXREQUEST)
+        return -1;
 
-    while ((nread = rio_readlineb(rioserverp, header, MAXLINE)) != 0) {
-        printf("s> %s", header);
-        rio_writen(connfd, header, strlen(header));
+    memcpy(conn->request + conn->request_len, data, len);
+    conn->request_len += len;
+    return 0;
+}
 
-        sscanf(header, "%s %s", headname, headval);
+/*
+ * read_head - Read until rp holds a whole message head and parse it in
+ *     place. The head starts at rp->rio_bufptr and is left unconsumed.
+ *     Returns its length, 0 on EOF before any of it arrived, or -1 if it
+ *     is malformed, cut short, or does not fit in the rio buffer.
+ */
+static int read_head(rio_t *rp, HttpHead *head, int request) {
+    ssize_t n;
+    int rc;
 
-        // Content-length
-        if (strcmp(headname, "Content-length:") == 0) {
-            content_len = atoi(headval);
+    http_head_init(head);
+    while (1) {
+        if (rp->rio_cnt > 0) {
+            if (request)
+                rc = http_parse_request(head, rp->rio_bufptr, rp->rio_cnt);
+            else
+                rc = http_parse_response(head, rp->rio_bufptr, rp->rio_cnt);
+            if (rc != HTTP_PARSE_MORE)
+                return rc;
         }
 
-        // Content-type
-        if (strcmp(headname, "Content-type:") == 0) {
-            strcpy(content_type, headval);
+        if ((n = rio_fillb(rp)) <= 0)
+            return (n == 0 && rp->rio_cnt <= 0) ? 0 : -1;
+    }
+}
+
+/* Queue len bytes at data for the next rio_writev() */
+static void iov_push(struct iovec *iov, int *iovcnt, char *data, int len) {
+    iov[*iovcnt].iov_base = data;
+    iov[*iovcnt].iov_len = len;
+    (*iovcnt)++;
+}
+
+/*
+ * relay_splice - Zero-copy tail of relay_body for bytes that are not being
+ *     cached. Returns 0 or -1 like relay_body, or 1 if splice() does not
+ *     work for these sockets and nothing was moved.
+ */
+static int relay_splice(ProxyConn *conn, int serverfd, int n, int *received) {
+    long moved = 0, pending = 0;
+    int rc;
+
+    if (conn->pipefd[0] < 0 && pipe(conn->pipefd) < 0)
+        return 1;
+
+    rc = zc_splice(serverfd, conn->connfd, conn->pipefd, n, &moved, &pending);
+    *received += moved;
+    if (rc == 0)
+        return 0;
+
+    if (rc < 0 && moved == 0 && pending == 0 && (errno == EINVAL || errno == ENOSYS))
+        return 1;
+
+    // the pipe may still hold bytes, start over with a fresh one
+    close(conn->pipefd[0]);
+    close(conn->pipefd[1]);
+    conn->pipefd[0] = conn->pipefd[1] = -1;
+    return -1;
+}
+
+/*
+ * relay_body - Forward n body bytes from the server to the client, or
+ *     everything up to EOF if n < 0, through a fixed MAXBUF buffer. While
+ *     *content is non-NULL the bytes land in it instead (it holds at least
+ *     MAX_OBJECT_SIZE + MAXBUF bytes, or exactly n for a known length) and
+ *     it is dropped once the body outgrows MAX_OBJECT_SIZE. Bytes are also
+ *     written to conn->store_fd while it is open, which is closed once the
+ *     body outgrows the cache's max_object. With -z, bytes that are neither
+ *     buffered by rio nor kept go through relay_splice.
+ *     Returns 0 when all n bytes (or EOF) were relayed, -1 otherwise.
+ */
+static int relay_body(ProxyConn *conn, rio_t *rioserverp, int n, char **content, int *received) {
+    char buf[MAXBUF];
+    ssize_t nread;
+    int splice_ok = zerocopy;
+    int rc;
+
+    while (n != 0) {
+        if (splice_ok && *content == NULL && conn->store_fd < 0 && rioserverp->rio_cnt <= 0) {
+            if ((rc = relay_splice(conn, rioserverp->rio_fd, n, received)) <= 0)
+                return rc;
+            splice_ok = 0;   /* unsupported here, copy instead */
         }
 
-        if (strcmp(header, "\r\n") == 0) {
-            nread = rio_readnb(rioserverp, content, content_len);
+        char *dst = *content != NULL ? *content + *received : buf;
+        int want = (n < 0 || n > MAXBUF) ? MAXBUF : n;
 
-            if (nread != content_len) {
-                printf(" * Received (%d) less bytes than promised (%d)", nread, content_len);
-                exit(0);
-            }
+        if ((nread = rio_readsomeb(rioserverp, dst, want)) < 0)
+            return -1;
+        if (nread == 0)
+            return n < 0 ? 0 : -1;
+        if (rio_writen(conn->connfd, dst, nread) < 0)
+            return -1;
+
+        *received += nread;
+        if (n > 0)
+            n -= nread;
 
-            printf(" | content_len: %d\n", content_len);
-            printf(" | nread: %d\n", nread);
+        if (*content != NULL && *received > MAX_OBJECT_SIZE) {
+            Free(*content);
+            *content = NULL;
+            flight_land(conn);
+        }
+        if (conn->store_fd >= 0 && (*received > cache->max_object ||
+                rio_writen(conn->store_fd, dst, nread) != nread)) {
+            close(conn->store_fd);
+            conn->store_fd = -1;
+            flight_land(conn);
+        }
+    }
 
-            Rio_writen(connfd, content, content_len);
+    return 0;
+}
 
-            if (content_len <= MAX_OBJECT_SIZE) {
-                cache_add(cache, uri2, content_len, content_type, content);
-            }
+/*
+ * relay_chunked - Decode a chunked body for the cache. The payload goes to
+ *     the client re-framed as one chunk per server chunk if rechunk is set,
+ *     or as a plain close-delimited body otherwise. Returns 0 or -1 like
+ *     relay_body.
+ */
+static int relay_chunked(ProxyConn *conn, rio_t *rioserverp, int rechunk, char **content, int *received) {
+    char line[MAXLINE];
+    char *crlf = "";    // ends the previous chunk, sent with the next size line
+    ssize_t nread;
+    long size;
 
+    while (1) {
+        if (rio_readlineb(rioserverp, line, MAXLINE) <= 0)
+            return -1;
+        if ((size = strtol(line, NULL, 16)) <= 0)
             break;
+        if (size > INT_MAX - *received)
+            return -1;
+
+        if (rechunk) {
+            int len = snprintf(line, MAXLINE, "%s%lx\r\n", crlf, size);
+            if (rio_writen(conn->connfd, line, len) < 0)
+                return -1;
+            crlf = "\r\n";
+        }
+
+        if (relay_body(conn, rioserverp, size, content, received) < 0)
+            return -1;
+
+        // CRLF closing the chunk data
+        if (rio_readlineb(rioserverp, line, MAXLINE) <= 0)
+            return -1;
+    }
+
+    if (size < 0)
+        return -1;
+    if (rechunk) {
+        int len = snprintf(line, MAXLINE, "%s0\r\n\r\n", crlf);
+        if (rio_writen(conn->connfd, line, len) < 0)
+            return -1;
+    }
+
+    // skip trailers
+    while ((nread = rio_readlineb(rioserverp, line, MAXLINE)) > 0) {
+        if (strcmp(line, "\r\n") == 0)
+            return 0;
+    }
+    return -1;
+}
+
+/*
+ * redir_back - Relay one response from the server to the client. Returns
+ *     RELAY_KEEP if the server connection is left clean at a message
+ *     boundary and may be pooled, RELAY_DONE if it must be closed,
+ *     RELAY_NO_RESPONSE if the server closed without answering, and
+ *     RELAY_ERROR if the relay broke off part way.
+ */
+int redir_back(ProxyConn *conn, int clientfd, rio_t *rioserverp) {
+    int connfd = conn->connfd;
+    HttpHead *head = &conn->response_head;
+    HttpHeader *h;
+    struct iovec iov[MAXHEADIOV];
+    int iovcnt = 0;
+    ssize_t sent;
+    char *buf;
+    int head_len, i;
+
+    log_debug(" * Redirecting back...\n");
+
+    Freshness fresh;
+    char *content = NULL;   // copy of the body kept for the cache
+    char *stored = NULL;    // and its headers, taken while buf still holds them
+    int content_len = -1;   // -1 until a Content-length header shows up
+    int chunked = 0;
+    int received = 0;
+    int status;
+    int keep;
+    int rc;
+
+    // response head, parsed in place in the rio buffer
+    if ((head_len = read_head(rioserverp, head, 0)) <= 0)
+        return (head_len == 0 || rioserverp->rio_cnt <= 0) ? RELAY_NO_RESPONSE : RELAY_ERROR;
+    stats_time(STAT_FIRST_BYTE, stats_now_us() - conn->t_sent);
+    buf = rioserverp->rio_bufptr;
+    status = head->status;
+    log_debug("s> %.*s", head_len, buf);
+
+    // HTTP/1.1 connections persist unless the server says otherwise
+    keep = http_slice_is(buf, head->version, "HTTP/1.1");
+    fresh_parse(head, buf, time(NULL), &fresh);
+
+    // our revalidation: a 304 refreshes the entry and the client gets that,
+    // anything else replaces it and is relayed as usual
+    if (conn->stale != NULL) {
+        if (status == 304) {
+            if ((h = http_find_header(head, buf, "Connection")) != NULL && http_slice_is(buf, h->value, "close"))
+                keep = 0;
+            rioserverp->rio_bufptr += head_len;
+            rioserverp->rio_cnt -= head_len;
+
+            cache_refresh(conn->stale, &fresh);
+            conn->revalidated = 1;
+            stats_count(STAT_REVALIDATED, 1);
+            log_debug(" + Not modified, cached copy refreshed\n");
+            return (keep && rioserverp->rio_cnt <= 0) ? RELAY_KEEP : RELAY_DONE;
+        }
+        cache_release(conn->stale);
+        conn->stale = NULL;
+    }
+
+    // these never carry a body, whatever the headers say
+    if (status / 100 == 1 || status == 204 || status == 304)
+        content_len = 0;
+
+    // the head is gathered from the rio buffer and sent with one writev()
+    iov_push(iov, &iovcnt, buf + head->start.off, head->start.len);
+    iov_push(iov, &iovcnt, "\r\n", 2);
+
+    // response headers
+    for (i = 0; i < head->nheaders; i++) {
+        h = &head->headers[i];
+
+        // Content-length (the value is followed by CRLF, so atoi stops there)
+        if (http_slice_is(buf, h->name, "Content-length") && content_len != 0) {
+            content_len = atoi(buf + h->value.off);
+        }
+
+        // Transfer-Encoding: the client gets the decoded body instead
+        if (http_slice_is(buf, h->name, "Transfer-Encoding") &&
+                http_slice_ends(buf, h->value, "chunked")) {
+            chunked = 1;
+            continue;
+        }
+
+        // hop-by-hop: decides the server connection, not the client's
+        if (http_slice_is(buf, h->name, "Connection")) {
+            if (http_slice_is(buf, h->value, "close"))
+                keep = 0;
+            else if (http_slice_is(buf, h->value, "keep-alive"))
+                keep = 1;
+            continue;
+        }
+        if (http_slice_is(buf, h->name, "Keep-Alive") ||
+                http_slice_is(buf, h->name, "Proxy-Connection"))
+            continue;
+
+        iov_push(iov, &iovcnt, buf + h->name.off, h->value.off + h->value.len - h->name.off);
+        iov_push(iov, &iovcnt, "\r\n", 2);
+    }
+
+    // the client can only stay if it can tell where the body ends
+    if (!chunked && content_len < 0)
+        conn->client_keep = 0;
+    if (chunked && !conn->client_http11)
+        conn->client_keep = 0;
+
+    if (chunked && conn->client_keep)
+        iov_push(iov, &iovcnt, "Transfer-Encoding: chunked\r\n", 28);
+    if (conn->client_keep)
+        iov_push(iov, &iovcnt, header_keepalive, strlen(header_keepalive));
+    else
+        iov_push(iov, &iovcnt, header_connection, strlen(header_connection));
+    iov_push(iov, &iovcnt, "\r\n", 2);
+
+    if ((sent = rio_writev(connfd, iov, iovcnt)) < 0)
+        return RELAY_ERROR;
+
+    // the body follows the head in the rio buffer
+    rioserverp->rio_bufptr += head_len;
+    rioserverp->rio_cnt -= head_len;
+
+    // a body that runs to EOF uses up the connection
+    if (!chunked && content_len < 0)
+        keep = 0;
+
+    // only complete 200 responses that fit, and that we may store, are worth
+    // keeping: straight into the file store if there is one, else on the heap
+    if (status == 200 && fresh.store && content_len <= cache->max_object &&
+            (conn->store_fd = cache_store_open(cache)) < 0) {
+        if (chunked || content_len < 0)
+            content = Malloc(MAX_OBJECT_SIZE + MAXBUF);
+        else if (content_len <= MAX_OBJECT_SIZE)
+            content = Malloc(content_len > 0 ? content_len : 1);
+    }
+
+    // nothing to wait for if it will not be cached
+    if (content == NULL && conn->store_fd < 0)
+        flight_land(conn);
+    else
+        stored = cache_header(head, buf);
+
+    // forward the body as it arrives, teeing it into content or store_fd
+    if (chunked)
+        rc = relay_chunked(conn, rioserverp, conn->client_keep, &content, &received);
+    else
+        rc = relay_body(conn, rioserverp, content_len, &content, &received);
+
+    log_debug(" | content_len: %d, received: %d\n", content_len, received);
+    log_info(" = access %s %d %d\n", conn->uri2, received, status);
+    stats_count(STAT_BYTES_ORIGIN, sent + received);
+
+    if (content != NULL || conn->store_fd >= 0) {
+        if (rc == 0 && content != NULL) {
+            content = Realloc(content, received > 0 ? received : 1);
+            cache_add(cache, conn->uri2, received, stored, content, &fresh);
+        }
+        else if (rc == 0) {
+            cache_add_file(cache, conn->uri2, received, stored, conn->store_fd, &fresh);
+        }
+        else {
+            log_info(" * Response ended early after %d bytes\n", received);
+            Free(stored);
+            if (content != NULL)
+                Free(content);
+            else
+                close(conn->store_fd);
         }
+        conn->store_fd = -1;
+        flight_land(conn);
     }
+    else if (stored != NULL) {
+        Free(stored);   /* the body outgrew the cache on the way */
+    }
+
+    if (rc < 0)
+        return RELAY_ERROR;
+
+    // anything left over means we lost track of message boundaries
+    return (keep && rioserverp->rio_cnt <= 0) ? RELAY_KEEP : RELAY_DONE;
 }
 
 void sigchld_handler(int sig) {
@@ -0,0 +1,16 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "cache.h"
+#include "httpparse.h"
+
+extern Cache *cache;
+extern char header_connection[MAXLINE];
+extern int zerocopy;
+
+int parse_uri(const char *buf, HttpSlice uri, char *shost, char *sport, char *spath);
+char *error_page(int status, const char *reason, int *len);
+int host_header(char *buf, const char *shost, const char *sport);
+
+#endif /* __PROXY_H__ */
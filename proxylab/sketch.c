@@ -0,0 +1,75 @@
+#include <string.h>
+#include "sketch.h"
+
+#define DOOR_BITS (8 * sizeof(((Sketch *)0)->door))
+
+/* Spread a 32-bit key hash into 64 bits, 16 of which pick each row's counter */
+static unsigned long sketch_mix(unsigned int hash) {
+    unsigned long x = hash;
+
+    x ^= x >> 16;
+    x *= 0x9e3779b97f4a7c15UL;
+    return x ^ (x >> 29);
+}
+
+static int sketch_index(unsigned long mix, int row) {
+    return (mix >> (16 * row)) & (SKETCH_WIDTH - 1);
+}
+
+/* The doorkeeper probes two bits, from the other end of the mix */
+static int door_test_and_set(Sketch *sk, unsigned long mix) {
+    unsigned int a = (mix >> 7) % DOOR_BITS, b = (mix >> 37) % DOOR_BITS;
+    int seen = (sk->door[a / 8] >> (a % 8) & 1) && (sk->door[b / 8] >> (b % 8) & 1);
+
+    sk->door[a / 8] |= 1 << (a % 8);
+    sk->door[b / 8] |= 1 << (b % 8);
+    return seen;
+}
+
+static int door_test(Sketch *sk, unsigned long mix) {
+    unsigned int a = (mix >> 7) % DOOR_BITS, b = (mix >> 37) % DOOR_BITS;
+
+    return (sk->door[a / 8] >> (a % 8) & 1) && (sk->door[b / 8] >> (b % 8) & 1);
+}
+
+/* Age everything: halve the counters and forget the doorkeeper */
+static void sketch_reset(Sketch *sk) {
+    int i, j;
+
+    for (i = 0; i < SKETCH_ROWS; i++) {
+        for (j = 0; j < SKETCH_WIDTH; j++)
+            sk->counts[i][j] >>= 1;
+    }
+    memset(sk->door, 0, sizeof(sk->door));
+    sk->additions = 0;
+}
+
+void sketch_add(Sketch *sk, unsigned int hash) {
+    unsigned long mix = sketch_mix(hash);
+    unsigned char *c;
+    int i;
+
+    if (++sk->additions >= SKETCH_SAMPLE)
+        sketch_reset(sk);
+
+    if (!door_test_and_set(sk, mix))
+        return;
+
+    for (i = 0; i < SKETCH_ROWS; i++) {
+        c = &sk->counts[i][sketch_index(mix, i)];
+        if (*c < SKETCH_MAX)
+            (*c)++;
+    }
+}
+
+/* Estimated recent accesses: the smallest counter, plus the doorkeeper's one */
+int sketch_estimate(Sketch *sk, unsigned int hash) {
+    unsigned long mix = sketch_mix(hash);
+    int i, n, min = SKETCH_MAX;
+
+    for (i = 0; i < SKETCH_ROWS; i++) {
+        if ((n = sk->counts[i][sketch_index(mix, i)]) < min)
+            min = n;
+    }
+    return min + door_test(sk, mix);
+}
@@ -0,0 +1,26 @@
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+#define SKETCH_ROWS 4
+#define SKETCH_WIDTH 1024       /* counters per row, a power of two */
+#define SKETCH_MAX 15           /* counters saturate here */
+#define SKETCH_SAMPLE (10 * SKETCH_WIDTH)   /* additions between halvings */
+
+/*
+ * TinyLFU frequency sketch: a count-min sketch of small saturating
+ * counters behind a doorkeeper bloom filter. A key's first sighting only
+ * sets its doorkeeper bits, so the many keys that are never seen again do
+ * not crowd the counters. Every SKETCH_SAMPLE additions all counters are
+ * halved and the doorkeeper cleared, so estimates follow recent traffic.
+ * Not thread safe; the cache keeps one per shard, under the shard lock.
+ */
+typedef struct {
+    unsigned char counts[SKETCH_ROWS][SKETCH_WIDTH];
+    unsigned char door[SKETCH_WIDTH / 2];   /* 4 * SKETCH_WIDTH bits */
+    int additions;
+} Sketch;
+
+void sketch_add(Sketch *sk, unsigned int hash);
+int sketch_estimate(Sketch *sk, unsigned int hash);
+
+#endif /* __SKETCH_H__ */
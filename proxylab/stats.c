@@ -0,0 +1,153 @@
+#include "proxy.h"
+#include "stats.h"
+#include "hist.h"
+
+/*
+ * One thread's numbers. Only the owner writes them, with relaxed atomic
+ * stores so that the page never reads a torn value; that compiles to
+ * plain moves.
+ */
+typedef struct StatsStruct {
+    long counters[STAT_NCOUNTERS];
+    Hist hists[STAT_NHISTS];
+    struct StatsStruct *next;   /* all blocks, newest first */
+} Stats;
+
+static const char *counter_names[STAT_NCOUNTERS] = {
+    "requests", "cache_hits", "cache_misses", "cache_coalesced", "cache_stale",
+    "cache_revalidated", "cache_inserts", "cache_rejected", "cache_evictions",
+    "bytes_from_cache", "bytes_from_origin", "upstream_connects", "upstream_reused", "errors"
+};
+static const char *hist_names[STAT_NHISTS] = {
+    "parse", "connect", "first_byte", "total"
+};
+
+static pthread_mutex_t blocks_lock = PTHREAD_MUTEX_INITIALIZER;
+static Stats *blocks;
+static __thread Stats *my_stats;
+static long start_us;
+
+/* This thread's block, registered on first use; threads never exit */
+static Stats *stats_block(void) {
+    if (my_stats == NULL) {
+        my_stats = Calloc(1, sizeof(Stats));
+        pthread_mutex_lock(&blocks_lock);
+        my_stats->next = blocks;
+        __atomic_store_n(&blocks, my_stats, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&blocks_lock);
+    }
+    return my_stats;
+}
+
+#define STAT_ADD(var, n) __atomic_store_n(&(var), (var) + (n), __ATOMIC_RELAXED)
+
+long stats_now_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void stats_init(void) {
+    start_us = stats_now_us();
+}
+
+void stats_count(int counter, long n) {
+    Stats *s = stats_block();
+
+    STAT_ADD(s->counters[counter], n);
+}
+
+void stats_time(int hist, long us) {
+    Hist *h = &stats_block()->hists[hist];
+
+    if (us < 0)
+        us = 0;
+    STAT_ADD(h->buckets[hist_bucket(us)], 1);
+    STAT_ADD(h->count, 1);
+    STAT_ADD(h->sum, us);
+    if (us > h->max)
+        __atomic_store_n(&h->max, us, __ATOMIC_RELAXED);
+}
+
+/*
+ * stats_render - Sum every thread's block and format the report into buf.
+ *     Returns its length.
+ */
+static int stats_render(char *buf, int size) {
+    long counters[STAT_NCOUNTERS] = { 0 };
+    static Hist hists[STAT_NHISTS];     /* too big for a worker's stack */
+    static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+    long lookups, v;
+    Hist *h;
+    Stats *s;
+    int i, j, len = 0;
+
+    pthread_mutex_lock(&render_lock);
+    memset(hists, 0, sizeof(hists));
+
+    for (s = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); s != NULL; s = s->next) {
+        for (i = 0; i < STAT_NCOUNTERS; i++)
+            counters[i] += __atomic_load_n(&s->counters[i], __ATOMIC_RELAXED);
+
+        for (i = 0; i < STAT_NHISTS; i++) {
+            h = &s->hists[i];
+            for (j = 0; j < HIST_BUCKETS; j++)
+                hists[i].buckets[j] += __atomic_load_n(&h->buckets[j], __ATOMIC_RELAXED);
+            hists[i].count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+            hists[i].sum += __atomic_load_n(&h->sum, __ATOMIC_RELAXED);
+            if ((v = __atomic_load_n(&h->max, __ATOMIC_RELAXED)) > hists[i].max)
+                hists[i].max = v;
+        }
+    }
+
+    len += snprintf(buf + len, size - len, "uptime_s %ld\n", (stats_now_us() - start_us) / 1000000);
+    for (i = 0; i < STAT_NCOUNTERS; i++)
+        len += snprintf(buf + len, size - len, "%s %ld\n", counter_names[i], counters[i]);
+
+    lookups = counters[STAT_HITS] + counters[STAT_MISSES];
+    len += snprintf(buf + len, size - len, "hit_ratio %.3f\n",
+            lookups > 0 ? (double)counters[STAT_HITS] / lookups : 0.0);
+    len += snprintf(buf + len, size - len, "cache_bytes_used %ld\ncache_capacity %ld\n",
+            cache->capacity - __atomic_load_n(&cache->free_space, __ATOMIC_RELAXED), cache->capacity);
+
+    len += snprintf(buf + len, size - len, "\n%-12s %8s %8s %8s %8s %8s %8s %8s\n",
+            "latency_us", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (i = 0; i < STAT_NHISTS; i++) {
+        h = &hists[i];
+        len += snprintf(buf + len, size - len, "%-12s %8ld %8ld %8ld %8ld %8ld %8ld %8ld\n",
+                hist_names[i], h->count, h->count > 0 ? h->sum / h->count : 0,
+                hist_percentile(h, 0.5), hist_percentile(h, 0.9),
+                hist_percentile(h, 0.99), hist_percentile(h, 0.999), h->max);
+    }
+
+    pthread_mutex_unlock(&render_lock);
+    return len < size ? len : size - 1;
+}
+
+/*
+ * stats_page - Build the complete response for path on STATS_HOST, with
+ *     the given Connection line: the report for STATS_PATH, a 404 for
+ *     anything else. Returns a Malloc'd buffer of *len bytes.
+ */
+char *stats_page(char *path, char *connection, int *len) {
+    char body[MAXBUF];
+    char *page;
+    int body_len, status;
+
+    if (strcmp(path, STATS_PATH) == 0) {
+        status = 200;
+        body_len = stats_render(body, MAXBUF);
+    }
+    else {
+        status = 404;
+        body_len = sprintf(body, "Not found\n");
+    }
+
+    page = Malloc(body_len + strlen(connection) + 128);
+    *len = sprintf(page, "HTTP/1.0 %d %s\r\nContent-type: text/plain\r\nContent-length: %d\r\n%s\r\n",
+            status, status == 200 ? "OK" : "Not Found", body_len, connection);
+    memcpy(page + *len, body, body_len);
+    *len += body_len;
+    return page;
+}
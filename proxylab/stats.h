@@ -0,0 +1,48 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+/* Answered by the proxy itself instead of being forwarded */
+#define STATS_HOST "proxy.local"
+#define STATS_PATH "/stats"
+
+/* Counters */
+enum {
+    STAT_REQUESTS,          /* requests parsed, not counting the stats page */
+    STAT_HITS,
+    STAT_MISSES,
+    STAT_COALESCED,         /* lookups that waited on another thread's fetch */
+    STAT_STALE,             /* misses that found an expired entry to revalidate */
+    STAT_REVALIDATED,       /* expired entries a 304 made fresh again */
+    STAT_INSERTS,           /* objects added to the cache */
+    STAT_REJECTED,          /* objects turned away by admission */
+    STAT_EVICTIONS,
+    STAT_BYTES_CACHE,       /* response bytes sent from the cache */
+    STAT_BYTES_ORIGIN,      /* response bytes relayed from servers */
+    STAT_UPSTREAM_NEW,      /* server connections opened */
+    STAT_UPSTREAM_REUSED,   /* pooled server connections reused */
+    STAT_ERRORS,            /* requests that failed after parsing */
+    STAT_NCOUNTERS
+};
+
+/* Latency histograms, in microseconds */
+enum {
+    STAT_PARSE,             /* head complete -> request rewritten */
+    STAT_CONNECT,           /* new server connection established */
+    STAT_FIRST_BYTE,        /* request sent -> response starts arriving */
+    STAT_TOTAL,             /* head complete -> response sent */
+    STAT_NHISTS
+};
+
+/*
+ * Every thread counts into a block of its own, so recording is a plain
+ * add with no locks or shared cache lines. The blocks are only summed up
+ * when the stats page is asked for, which makes the page approximate
+ * while requests are in flight.
+ */
+void stats_init(void);
+void stats_count(int counter, long n);
+void stats_time(int hist, long us);
+long stats_now_us(void);
+char *stats_page(char *path, char *connection, int *len);
+
+#endif /* __STATS_H__ */
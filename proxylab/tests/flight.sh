@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# flight.sh - Concurrent misses on one uri go to the origin once (threaded
+#     mode only; the event loop does not coalesce), and waiters still get
+#     the response when it turns out not to be cacheable.
+#
+. tests/lib.sh
+
+start_origin
+start_proxy "$@"
+
+for path in "/obj/5000/herd?slow" "/obj/200000/herd-big?slow" "/obj/5000/herd-err?slow,err"; do
+    pids=
+    for i in $(seq 1 20); do
+        get "$path" "$TMP/herd.$i" > "$TMP/code.$i" &
+        pids="$pids $!"
+    done
+    wait $pids
+
+    direct "$path" "$TMP/expect"
+    for i in $(seq 1 20); do
+        check "$path #$i body" cmp -s "$TMP/expect" "$TMP/herd.$i"
+    done
+    # too large to cache: once the leader gives up, the rest fetch it too
+    case $path in
+    *err*)
+        check "$path: every client got the 500" [ "$(cat "$TMP"/code.* | sort -u)" = 500 ]
+        ;;
+    *big*)
+        ;;
+    *)
+        check "$path: one origin fetch for 20 clients" [ "$(served "${path%%\?*}")" = "1 0" ]
+        ;;
+    esac
+done
+check "waiters counted as coalesced" [ "$(stat cache_coalesced)" -gt 0 ]
+
+finish
@@ -0,0 +1,51 @@
+#!/bin/sh
+#
+# fresh.sh - Freshness: what may be stored, what is served without asking,
+#     and stale entries refreshed by a 304 instead of fetched again.
+#
+. tests/lib.sh
+
+start_origin
+start_proxy "$@"
+
+kinds="maxage nostore private nocache mustrev age lm none"
+for kind in $kinds; do
+    get /fresh/$kind "$TMP/first" > /dev/null
+done
+check "all but no-store and private cached" wait_inserts 6
+for kind in $kinds; do
+    get /fresh/$kind "$TMP/second" > /dev/null
+    check "/fresh/$kind body" grep -q "body of /fresh/$kind" "$TMP/second"
+done
+
+# fresh ones are hits; no-store and private are not kept at all
+check "max-age hit" [ "$(served /fresh/maxage)" = "1 0" ]
+check "Last-Modified heuristic hit" [ "$(served /fresh/lm)" = "1 0" ]
+check "no freshness information, still a hit" [ "$(served /fresh/none)" = "1 0" ]
+check "no-store fetched every time" [ "$(served /fresh/nostore)" = "2 0" ]
+check "private fetched every time" [ "$(served /fresh/private)" = "2 0" ]
+check "no-cache revalidated every time" [ "$(served /fresh/nocache)" = "1 1" ]
+
+# an Age from further up is passed on and counts against the lifetime
+curl -s -m 5 -x "localhost:$PROXY_PORT" -D "$TMP/head" -o /dev/null "$ORIGIN/fresh/age"
+check "Age sent on a hit" grep -qi "^Age: 10[0-9]" "$TMP/head"
+
+# once stale, a 304 refreshes the entry and the client gets the body
+sleep 2.2
+check "/fresh/maxage after expiry" grep -q "body of" "$TMP/second"
+get /fresh/maxage "$TMP/third" > /dev/null
+check "/fresh/maxage body after a 304" grep -q "body of /fresh/maxage" "$TMP/third"
+check "stale entry revalidated, not fetched" [ "$(served /fresh/maxage)" = "1 1" ]
+check "revalidation counted" [ "$(stat cache_revalidated)" -ge 2 ]
+get /fresh/maxage "$TMP/fourth" > /dev/null
+check "refreshed entry is a hit again" [ "$(served /fresh/maxage)" = "1 1" ]
+
+# with the origin down, stale entries are served unless they must not be
+stop_origin
+sleep 1.2
+check "stale entry served while the origin is down" \
+    [ "$(get /fresh/maxage "$TMP/down")" = 200 ] && grep -q "body of" "$TMP/down"
+check "must-revalidate entry refused while the origin is down" \
+    [ "$(get /fresh/mustrev "$TMP/down")" != 200 ]
+
+finish
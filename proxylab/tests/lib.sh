@@ -0,0 +1,121 @@
+#
+# lib.sh - Shared by the tests: starts tests/origin.py and the proxy on
+#     local ports and provides checks. Sourced by each test, which gets the
+#     proxy options to run with as its arguments.
+#
+#     ORIGIN_PORT, PROXY_PORT   ports to use (18380 and 18381)
+#
+
+ORIGIN_PORT=${ORIGIN_PORT:-18380}
+PROXY_PORT=${PROXY_PORT:-18381}
+ORIGIN="http://localhost:$ORIGIN_PORT"
+
+TMP=$(mktemp -d /tmp/proxytest.XXXXXX)
+failures=0
+origin_pid=
+proxy_pid=
+
+cleanup() {
+    kill $origin_pid $proxy_pid 2> /dev/null
+    wait 2> /dev/null
+    rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+# wait_for url - until something answers at url, for up to 5 seconds
+wait_for() {
+    i=0
+    while ! curl -s -m 1 -o /dev/null "$@"; do
+        i=$((i + 1))
+        [ $i -ge 50 ] && return 1
+        sleep 0.1
+    done
+}
+
+start_origin() {
+    python3 tests/origin.py "$ORIGIN_PORT" &
+    origin_pid=$!
+    wait_for "$ORIGIN/count/x"
+}
+
+stop_origin() {
+    kill $origin_pid 2> /dev/null
+    wait $origin_pid 2> /dev/null
+    origin_pid=
+}
+
+# start_proxy [options] - start the proxy, its output going to $TMP/proxy.log
+start_proxy() {
+    ./proxy "$@" "$PROXY_PORT" >> "$TMP/proxy.log" 2>&1 &
+    proxy_pid=$!
+    wait_for -x "localhost:$PROXY_PORT" http://proxy.local/stats
+}
+
+# stop_proxy [signal] - stop it and wait for it to exit
+stop_proxy() {
+    kill -${1:-TERM} $proxy_pid 2> /dev/null
+    wait $proxy_pid 2> /dev/null
+    proxy_pid=
+}
+
+# get path out - fetch $ORIGIN/path through the proxy into out, print the status
+get() {
+    curl -s -m 10 -x "localhost:$PROXY_PORT" -o "$2" -w "%{http_code}\n" "$ORIGIN$1"
+}
+
+# direct path out - fetch $ORIGIN/path from the origin itself, uncounted
+direct() {
+    curl -s -m 10 -H "X-Test-Direct: 1" -o "$2" "$ORIGIN$1"
+}
+
+# stat name - a counter from the proxy's stats page
+stat() {
+    curl -s -m 5 -x "localhost:$PROXY_PORT" http://proxy.local/stats | awk -v n="$1" '$1 == n { print $2 }'
+}
+
+# wait_inserts n - until the proxy has cached n objects, for up to 5
+# seconds; a client may have its response before the proxy inserts it
+wait_inserts() {
+    i=0
+    while [ "$(stat cache_inserts)" -lt "$1" ]; do
+        i=$((i + 1))
+        [ $i -ge 50 ] && return 1
+        sleep 0.1
+    done
+}
+
+# served path - "<200s> <304s>" the origin answered for path
+served() {
+    curl -s -m 5 "$ORIGIN/count$1"
+}
+
+# check what command... - run the command, report a failure if it fails
+check() {
+    what=$1
+    shift
+    if "$@"; then
+        return 0
+    fi
+    echo "  FAIL: $what"
+    failures=$((failures + 1))
+    return 1
+}
+
+# same_body path - the proxy relays path exactly as the origin sends it
+same_body() {
+    direct "$1" "$TMP/direct" && [ "$(get "$1" "$TMP/proxied")" = 200 ] && cmp -s "$TMP/direct" "$TMP/proxied"
+}
+
+# proxy_alive - the proxy, if one was left running, has not crashed
+proxy_alive() {
+    [ -z "$proxy_pid" ] || kill -0 $proxy_pid 2> /dev/null
+}
+
+finish() {
+    check "proxy still running" proxy_alive
+    if [ $failures -gt 0 ]; then
+        echo "  proxy output:"
+        sed 's/^/    /' "$TMP/proxy.log"
+    fi
+    exit $((failures > 0))
+}
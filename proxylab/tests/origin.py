@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+#
+# origin.py - Origin server for the tests. Speaks HTTP/1.1 keep-alive and
+#     counts what it answers, so a test can tell what reached it.
+#
+#     GET /obj/<bytes>[/anything][?flags]
+#         a 200 with a <bytes> long body that depends on the whole path, so
+#         different uris never share a body. Flags, comma separated:
+#         chunked   send the body chunked
+#         nolen     no Content-length, the body runs to the close
+#         slow      wait half a second first
+#         err       answer 500 instead
+#         nostore   Cache-Control: no-store
+#     GET /fresh/<kind>
+#         a small 200 with the freshness headers of kind (see FRESH), and a
+#         304 when its validator is sent back
+#     GET /count/<path>
+#         "<200s> <304s>" answered so far for /<path>, leaving out requests
+#         with an X-Test-Direct header (the tests' own, bypassing the proxy)
+#
+#     usage: origin.py <port>
+
+import sys
+import threading
+import time
+from email.utils import formatdate
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+ETAG = '"v1"'
+LAST_MODIFIED = "Sun, 06 Nov 1994 08:49:37 GMT"
+
+# /fresh/<kind>: headers sent, and the validator that earns a 304
+FRESH = {
+    "maxage":  ([("Cache-Control", "max-age=2"), ("ETag", ETAG)], "etag"),
+    "nostore": ([("Cache-Control", "no-store")], None),
+    "private": ([("Cache-Control", "private, max-age=100")], None),
+    "nocache": ([("Cache-Control", "no-cache"), ("ETag", ETAG)], "etag"),
+    "mustrev": ([("Cache-Control", "max-age=1, must-revalidate"), ("ETag", ETAG)], "etag"),
+    "age":     ([("Cache-Control", "max-age=100"), ("Age", "100"), ("ETag", ETAG)], "etag"),
+    "lm":      ([("Last-Modified", LAST_MODIFIED)], "lm"),
+    "none":    ([], None),
+}
+
+counts = {}
+lock = threading.Lock()
+
+
+def tally(path, status):
+    with lock:
+        counts[(path, status)] = counts.get((path, status), 0) + 1
+
+
+def body_of(path, size):
+    unit = (path + "\n").encode()
+    return (unit * (size // len(unit) + 1))[:size]
+
+
+class Handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, *args):
+        pass
+
+    def send(self, status, headers, body=b"", chunked=False, nolen=False):
+        self.send_response(status)
+        self.send_header("Date", formatdate(usegmt=True))
+        for name, value in headers:
+            self.send_header(name, value)
+        if chunked:
+            self.send_header("Transfer-Encoding", "chunked")
+        elif nolen:
+            self.send_header("Connection", "close")
+            self.close_connection = True
+        elif status != 304:
+            self.send_header("Content-length", str(len(body)))
+        self.end_headers()
+
+        if chunked:
+            for i in range(0, len(body), 3000):
+                piece = body[i:i + 3000]
+                self.wfile.write(b"%x\r\n" % len(piece) + piece + b"\r\n")
+            self.wfile.write(b"0\r\n\r\n")
+        elif status != 304:
+            self.wfile.write(body)
+
+    def count(self, path, status):
+        if self.headers.get("X-Test-Direct") is None:
+            tally(path, status)
+
+    def do_GET(self):
+        path, _, query = self.path.partition("?")
+        flags = query.split(",") if query else []
+
+        if path.startswith("/count/"):
+            target = path[len("/count"):]
+            with lock:
+                answer = "%d %d\n" % (counts.get((target, 200), 0), counts.get((target, 304), 0))
+            return self.send(200, [("Cache-Control", "no-store")], answer.encode())
+
+        if path.startswith("/fresh/") and path[len("/fresh/"):] in FRESH:
+            headers, validator = FRESH[path[len("/fresh/"):]]
+            if ((validator == "etag" and self.headers.get("If-None-Match") == ETAG) or
+                    (validator == "lm" and self.headers.get("If-Modified-Since") == LAST_MODIFIED)):
+                self.count(path, 304)
+                return self.send(304, headers)
+            self.count(path, 200)
+            return self.send(200, headers + [("Content-type", "text/plain")],
+                             ("body of %s\n" % path).encode() * 10)
+
+        parts = path.split("/")
+        if len(parts) < 3 or parts[1] != "obj" or not parts[2].isdigit():
+            return self.send(404, [], b"not found\n")
+
+        if "slow" in flags:
+            time.sleep(0.5)
+        status = 500 if "err" in flags else 200
+        self.count(path, status)
+        headers = [("Content-type", "application/octet-stream")]
+        if "nostore" in flags:
+            headers.append(("Cache-Control", "no-store"))
+        self.send(status, headers, body_of(path, int(parts[2])),
+                  chunked="chunked" in flags, nolen="nolen" in flags)
+
+
+ThreadingHTTPServer.daemon_threads = True
+ThreadingHTTPServer(("127.0.0.1", int(sys.argv[1])), Handler).serve_forever()
@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# relay.sh - Bodies of every framing and size arrive intact, on a miss and
+#     on a hit, and under concurrent requests; small objects are cached.
+#
+. tests/lib.sh
+
+start_origin
+start_proxy "$@"
+
+for round in 1 2; do
+    for size in 6 50000 3000000; do
+        for flags in "" "?nolen" "?chunked"; do
+            check "/obj/$size$flags, fetch $round" same_body "/obj/$size/relay${flags#\?}$flags"
+        done
+    done
+    [ $round = 1 ] && check "objects up to MAX_OBJECT_SIZE cached" wait_inserts 6
+done
+
+# the plain small object above was fetched once, then hit
+check "small object served from the cache" [ "$(served /obj/6/relay)" = "1 0" ]
+
+# many clients at once, on one object and on many
+direct /obj/20000/crowd "$TMP/expect"
+pids=
+for i in $(seq 1 20); do
+    get /obj/20000/crowd "$TMP/crowd.$i" > /dev/null &
+    pids="$pids $!"
+    get /obj/7000/many-$i "$TMP/many.$i" > /dev/null &
+    pids="$pids $!"
+done
+wait $pids
+for i in $(seq 1 20); do
+    direct /obj/7000/many-$i "$TMP/many.expect"
+    check "concurrent hit #$i" cmp -s "$TMP/expect" "$TMP/crowd.$i"
+    check "concurrent miss #$i" cmp -s "$TMP/many.expect" "$TMP/many.$i"
+done
+
+finish
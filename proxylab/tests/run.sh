@@ -0,0 +1,34 @@
+#!/bin/sh
+#
+# run.sh - Run each test against the proxy in threaded and in epoll (-e)
+#     mode, and report the ones that failed. Run it from proxylab, usually
+#     as "make check"; name tests to run only those, e.g.
+#     "tests/run.sh fresh store".
+#
+#     PROXY_OPTS    extra proxy options for every run, e.g. "-n 4"
+#
+
+tests=${*:-relay flight fresh snapshot store splice}
+failed=
+
+for test in $tests; do
+    for mode in threaded epoll; do
+        opts=$PROXY_OPTS
+        if [ $mode = epoll ]; then
+            # only threaded mode coalesces misses
+            [ $test = flight ] && continue
+            opts="-e $opts"
+        fi
+
+        echo "$test ($mode)"
+        if ! sh tests/$test.sh $opts; then
+            failed="$failed $test($mode)"
+        fi
+    done
+done
+
+if [ -n "$failed" ]; then
+    echo "FAILED:$failed"
+    exit 1
+fi
+echo "All tests passed"
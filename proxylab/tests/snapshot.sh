@@ -0,0 +1,43 @@
+#!/bin/sh
+#
+# snapshot.sh - A cache saved on exit is loaded by the next proxy and
+#     served with the origin gone; entries too large for the next cache
+#     are skipped without losing the rest.
+#
+. tests/lib.sh
+
+start_origin
+start_proxy -d "$TMP/snap" "$@"
+for path in /obj/6/a /obj/50000/b /obj/3000/c?chunked /fresh/maxage; do
+    direct "$path" "$TMP/expect.${path##*/}"
+    get "$path" /dev/null > /dev/null
+done
+check "all four cached" wait_inserts 4
+stop_proxy TERM
+check "snapshot written on SIGTERM" [ -s "$TMP/snap" ]
+stop_origin
+
+start_proxy -d "$TMP/snap" "$@"
+check "snapshot loaded" grep -q "Loaded 4 cached objects" "$TMP/proxy.log"
+for path in /obj/6/a /obj/50000/b /obj/3000/c?chunked; do
+    check "$path served from the snapshot" [ "$(get "$path" "$TMP/warm")" = 200 ]
+    check "$path body from the snapshot" cmp -s "$TMP/expect.${path##*/}" "$TMP/warm"
+done
+get /fresh/maxage "$TMP/warm" > /dev/null
+check "freshness kept in the snapshot" grep -q "body of /fresh/maxage" "$TMP/warm"
+stop_proxy INT
+
+# saved with a file store, loaded into the heap cache
+start_origin
+mkdir "$TMP/store"
+start_proxy -d "$TMP/snap.big" -f "$TMP/store" "$@"
+get /obj/3000000/big /dev/null > /dev/null
+get /obj/6/small /dev/null > /dev/null
+check "both cached" wait_inserts 2
+stop_proxy TERM
+start_proxy -d "$TMP/snap.big" "$@"
+check "oversized entry skipped, the rest loaded" grep -q "Loaded 1 cached objects from $TMP/snap.big" "$TMP/proxy.log"
+check "entry after the oversized one served" same_body /obj/6/small
+check "it came from the snapshot" [ "$(served /obj/6/small)" = "1 0" ]
+
+finish
@@ -0,0 +1,19 @@
+#!/bin/sh
+#
+# splice.sh - With -z, bodies that are not cached go through splice() and
+#     still arrive intact, whatever their framing.
+#
+. tests/lib.sh
+
+start_origin
+start_proxy -z "$@"
+
+for flags in "" "?nolen" "?chunked" "?nostore"; do
+    check "/obj/3000000/splice$flags" same_body "/obj/3000000/splice$flags"
+done
+check "small object relayed" same_body /obj/5000/small
+check "small object cached" wait_inserts 1
+check "small object hit" same_body /obj/5000/small
+check "one fetch for the small object" [ "$(served /obj/5000/small)" = "1 0" ]
+
+finish
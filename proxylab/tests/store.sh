@@ -0,0 +1,35 @@
+#!/bin/sh
+#
+# store.sh - With a file store, objects far above MAX_OBJECT_SIZE are
+#     cached and sent back intact with sendfile().
+#
+. tests/lib.sh
+
+start_origin
+mkdir "$TMP/store"
+start_proxy -f "$TMP/store" "$@"
+
+n=0
+for flags in "" "?nolen"; do
+    path="/obj/3000000/store${flags#\?}$flags"
+    n=$((n + 1))
+    for round in 1 2 3; do
+        check "$path, fetch $round" same_body "$path"
+        [ $round = 1 ] && check "$path cached" wait_inserts $n
+    done
+    check "$path fetched once" [ "$(served "${path%%\?*}")" = "1 0" ]
+done
+check "hits counted" [ "$(stat cache_hits)" -ge 4 ]
+
+# too large for the store budget's share: relayed, never cached
+stop_proxy
+start_proxy -f "$TMP/store" -F 8000000 "$@"
+for round in 1 2; do
+    check "/obj/2000000/over, fetch $round" same_body /obj/2000000/over
+done
+check "/obj/2000000/over not cached" [ "$(served /obj/2000000/over)" = "2 0" ]
+
+# the store files are unlinked as they are made
+check "no files left in the store" [ -z "$(ls "$TMP/store")" ]
+
+finish
@@ -0,0 +1,325 @@
+#include <poll.h>
+#include <time.h>
+#include "csapp.h"
+#include "cache.h"
+#include "dns.h"
+#include "log.h"
+#include "upstream.h"
+
+typedef struct UpstreamConnStruct {
+    int fd;
+    time_t idle_since;
+    struct UpstreamConnStruct *next;
+} UpstreamConn;
+
+/* Idle connections to one origin, most recently used first */
+typedef struct UpstreamHostStruct {
+    char *key;                          /* "host:port" */
+    unsigned int hash;
+    int nidle;
+    UpstreamConn *idle;
+    struct UpstreamHostStruct *hnext;   /* bucket chain */
+} UpstreamHost;
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static UpstreamHost *buckets[UPSTREAM_BUCKETS];
+static int max_idle = UPSTREAM_MAX_IDLE;
+static int idle_timeout = UPSTREAM_IDLE_TIMEOUT;
+static int total_idle;      /* over all origins, at most UPSTREAM_MAX_IDLE_TOTAL */
+static time_t last_sweep;
+int connect_timeout = UPSTREAM_CONNECT_TIMEOUT;
+
+void upstream_init(int max, int timeout, int connect_ms) {
+    max_idle = max;
+    idle_timeout = timeout;
+    connect_timeout = connect_ms;
+}
+
+/* Monotonic clock in milliseconds, for connect deadlines */
+long upstream_now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/* Find (or, with create, add) the entry for key; the caller holds pool_lock */
+static UpstreamHost *upstream_host(char *key, int create) {
+    unsigned int hash = cache_hash(key);
+    UpstreamHost **bucket = &buckets[hash & (UPSTREAM_BUCKETS - 1)];
+    UpstreamHost *host;
+
+    for (host = *bucket; host != NULL; host = host->hnext) {
+        if (host->hash == hash && strcmp(host->key, key) == 0)
+            return host;
+    }
+    if (!create)
+        return NULL;
+
+    host = Calloc(1, sizeof(UpstreamHost));
+    host->key = strdup(key);
+    host->hash = hash;
+    host->hnext = *bucket;
+    *bucket = host;
+    return host;
+}
+
+/*
+ * upstream_expire - Unlink idle connections older than idle_timeout and
+ *     add them to *expired for the caller to close outside the lock.
+ */
+static void upstream_expire(UpstreamHost *host, time_t now, UpstreamConn **expired) {
+    UpstreamConn **link = &host->idle;
+    UpstreamConn *stale, *next;
+
+    // the list is MRU first, so everything past the first stale one is stale
+    while (*link != NULL && now - (*link)->idle_since < idle_timeout)
+        link = &(*link)->next;
+
+    for (stale = *link, *link = NULL; stale != NULL; stale = next) {
+        next = stale->next;
+        stale->next = *expired;
+        *expired = stale;
+        host->nidle--;
+        total_idle--;
+    }
+}
+
+/*
+ * upstream_sweep - At most once a second, expire the idle connections of
+ *     every origin and free the origins left with none, so an origin that
+ *     is never asked for again does not keep its sockets or its entry.
+ *     The caller holds pool_lock.
+ */
+static void upstream_sweep(time_t now, UpstreamConn **expired) {
+    UpstreamHost **link, *host;
+    int i;
+
+    if (now == last_sweep)
+        return;
+    last_sweep = now;
+
+    for (i = 0; i < UPSTREAM_BUCKETS; i++) {
+        link = &buckets[i];
+        while ((host = *link) != NULL) {
+            upstream_expire(host, now, expired);
+            if (host->idle != NULL) {
+                link = &host->hnext;
+                continue;
+            }
+            *link = host->hnext;
+            Free(host->key);
+            Free(host);
+        }
+    }
+}
+
+static void upstream_close_all(UpstreamConn *conn) {
+    while (conn != NULL) {
+        UpstreamConn *next = conn->next;
+        close(conn->fd);
+        Free(conn);
+        conn = next;
+    }
+}
+
+/* An idle keep-alive socket must have nothing to read and not be at EOF */
+static int upstream_alive(int fd) {
+    char c;
+
+    return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+           (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * upstream_race - Start a non-blocking connect to the next address that
+ *     takes one. Returns 1 if it is in flight (added to fds), 0 if it
+ *     connected at once (*fd set), -1 if no address is left.
+ */
+static int upstream_race(struct addrinfo **next, struct pollfd *fds, int *nfds, int *fd) {
+    struct addrinfo *p;
+    int s;
+
+    while ((p = *next) != NULL) {
+        *next = p->ai_next;
+
+        if ((s = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol)) < 0)
+            continue;
+        if (connect(s, p->ai_addr, p->ai_addrlen) == 0) {
+            *fd = s;
+            return 0;
+        }
+        if (errno != EINPROGRESS) {
+            close(s);
+            continue;
+        }
+
+        fds[*nfds].fd = s;
+        fds[*nfds].events = POLLOUT;
+        (*nfds)++;
+        return 1;
+    }
+    return -1;
+}
+
+/*
+ * upstream_connect - Happy eyeballs (RFC 8305) over the resolver cache's
+ *     address list, which alternates address families: start with the
+ *     first address, add the next one every UPSTREAM_STAGGER ms or as soon
+ *     as an attempt fails, keep the first to complete and close the rest.
+ *     Returns a blocking socket, -2 if the name did not resolve, or -1 if
+ *     nothing connected within connect_timeout ms.
+ */
+static int upstream_connect(char *host, char *port) {
+    struct pollfd fds[UPSTREAM_MAX_RACE];
+    struct addrinfo *listp, *next;
+    long deadline, wait;
+    int nfds = 0, fd = -1, start = 1;
+    int i, rc, err;
+    socklen_t len;
+
+    if ((rc = dns_lookup(host, port, &listp)) != 0) {
+        log_warn("getaddrinfo failed (%s:%s): %s\n", host, port, gai_strerror(rc));
+        return -2;
+    }
+
+    next = listp;
+    deadline = upstream_now_ms() + connect_timeout;
+
+    while (fd < 0) {
+        if (start && nfds < UPSTREAM_MAX_RACE && upstream_race(&next, fds, &nfds, &fd) == 0)
+            break;
+        if (nfds == 0)
+            break;   /* every address failed */
+
+        if ((wait = deadline - upstream_now_ms()) <= 0) {
+            log_warn(" - Connect to %s:%s timed out\n", host, port);
+            break;
+        }
+        if (next != NULL && wait > UPSTREAM_STAGGER)
+            wait = UPSTREAM_STAGGER;
+
+        if ((rc = poll(fds, nfds, wait)) < 0) {
+            if (errno != EINTR)
+                break;
+            start = 0;
+            continue;
+        }
+
+        // nothing yet: time to race the next address
+        start = rc == 0;
+
+        for (i = 0; rc > 0 && i < nfds; ) {
+            if (fds[i].revents == 0) {
+                i++;
+                continue;
+            }
+
+            len = sizeof(err);
+            if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+                err = errno;
+            if (err == 0) {
+                fd = fds[i].fd;
+                fds[i] = fds[--nfds];
+                break;
+            }
+
+            // this one failed, bring in the next without waiting
+            close(fds[i].fd);
+            fds[i] = fds[--nfds];
+            start = 1;
+        }
+    }
+
+    for (i = 0; i < nfds; i++)
+        close(fds[i].fd);
+    dns_freeaddrinfo(listp);
+
+    // the rest of the proxy does blocking i/o on it
+    if (fd >= 0)
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return fd;
+}
+
+/*
+ * upstream_get - Return a connection to host:port, preferring a pooled
+ *     one (*reused = 1) over a fresh connect (*reused = 0). Returns -1 if
+ *     no connection could be made.
+ */
+int upstream_get(char *host, char *port, int *reused) {
+    char key[MAXLINE];
+    UpstreamHost *entry;
+    UpstreamConn *conn, *expired;
+    time_t now;
+    int fd;
+
+    snprintf(key, MAXLINE, "%s:%s", host, port);
+
+    while (max_idle > 0) {
+        now = time(NULL);
+        expired = conn = NULL;
+
+        pthread_mutex_lock(&pool_lock);
+        upstream_sweep(now, &expired);
+        if ((entry = upstream_host(key, 0)) != NULL) {
+            upstream_expire(entry, now, &expired);
+            if ((conn = entry->idle) != NULL) {
+                entry->idle = conn->next;
+                entry->nidle--;
+                total_idle--;
+            }
+        }
+        pthread_mutex_unlock(&pool_lock);
+
+        upstream_close_all(expired);
+        if (conn == NULL)
+            break;
+
+        fd = conn->fd;
+        Free(conn);
+        if (upstream_alive(fd)) {
+            *reused = 1;
+            return fd;
+        }
+        close(fd);   /* the origin closed it while idle */
+    }
+
+    *reused = 0;
+    return upstream_connect(host, port);
+}
+
+/* Return a connection that finished a response cleanly to the pool */
+void upstream_put(char *host, char *port, int fd) {
+    char key[MAXLINE];
+    UpstreamHost *entry;
+    UpstreamConn *conn, *expired = NULL;
+
+    if (max_idle <= 0) {
+        close(fd);
+        return;
+    }
+
+    snprintf(key, MAXLINE, "%s:%s", host, port);
+    conn = Malloc(sizeof(UpstreamConn));
+    conn->fd = fd;
+    conn->idle_since = time(NULL);
+
+    pthread_mutex_lock(&pool_lock);
+    upstream_sweep(conn->idle_since, &expired);
+    entry = upstream_host(key, 1);
+    upstream_expire(entry, conn->idle_since, &expired);
+    if (entry->nidle < max_idle && total_idle < UPSTREAM_MAX_IDLE_TOTAL) {
+        conn->next = entry->idle;
+        entry->idle = conn;
+        entry->nidle++;
+        total_idle++;
+        conn = NULL;
+    }
+    pthread_mutex_unlock(&pool_lock);
+
+    upstream_close_all(expired);
+    if (conn != NULL) {
+        close(fd);   /* already at the per-origin or global limit */
+        Free(conn);
+    }
+}
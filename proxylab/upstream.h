@@ -0,0 +1,31 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#define UPSTREAM_BUCKETS 256        /* origin index size, a power of two */
+#define UPSTREAM_MAX_IDLE 8         /* default idle connections per origin */
+#define UPSTREAM_MAX_IDLE_TOTAL 256 /* idle connections over all origins */
+#define UPSTREAM_IDLE_TIMEOUT 30    /* default seconds before an idle one closes */
+#define UPSTREAM_CONNECT_TIMEOUT 3000   /* default ms to establish a connection */
+#define UPSTREAM_STAGGER 250        /* ms before racing the next address */
+#define UPSTREAM_MAX_RACE 8         /* connects in flight at once */
+
+/*
+ * Pool of persistent (HTTP/1.1 keep-alive) connections to origin servers,
+ * keyed by "host:port". A worker takes a connection with upstream_get(),
+ * sends one request on it and, if the response left it reusable, hands it
+ * back with upstream_put(); otherwise it just closes it. Every get and put
+ * also sweeps out connections idle for too long at any origin, at most
+ * once a second.
+ *
+ * New connections race the server's addresses (happy eyeballs) and give
+ * up after connect_timeout ms, so a dead address costs at most a stagger
+ * rather than the kernel's connect timeout.
+ */
+extern int connect_timeout;    /* ms, also used by the event loop */
+
+void upstream_init(int max_idle, int idle_timeout, int connect_timeout);
+int upstream_get(char *host, char *port, int *reused);
+void upstream_put(char *host, char *port, int fd);
+long upstream_now_ms(void);
+
+#endif /* __UPSTREAM_H__ */
@@ -0,0 +1,70 @@
+/*
+ * zcopy.c - Zero-copy relaying between sockets.
+ *
+ * Kept apart from csapp.c because splice() needs _GNU_SOURCE, which
+ * clashes with csapp.h's gai_error().
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include "zcopy.h"
+
+int zc_splice(int from, int to, int pipefd[2], long n, long *moved, long *pending) {
+    unsigned int flags = SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK;
+    ssize_t in, out;
+
+    while (1) {
+        // drain what is already in the pipe
+        while (*pending > 0) {
+            if ((out = splice(pipefd[0], NULL, to, NULL, *pending, flags)) < 0) {
+                if (errno == EINTR)
+                    continue;
+                return (errno == EAGAIN) ? 1 : -1;
+            }
+            *pending -= out;
+            *moved += out;
+        }
+
+        if (n == 0)
+            return 0;
+
+        in = splice(from, NULL, pipefd[1], NULL, (n < 0 || n > ZC_CHUNK) ? ZC_CHUNK : n, flags);
+        if (in < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN) ? 1 : -1;
+        }
+        if (in == 0) {
+            if (n < 0)
+                return 0;   /* EOF ends a close-delimited body */
+            errno = EPIPE;
+            return -1;
+        }
+
+        *pending += in;
+        if (n > 0)
+            n -= in;
+    }
+}
+
+int zc_sendfile(int to, int fd, long *offset, long count) {
+    off_t off;
+    ssize_t n;
+
+    while (*offset < count) {
+        off = *offset;   /* explicit offset: readers can share fd */
+        if ((n = sendfile(to, fd, &off, count - *offset)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN) ? 1 : -1;
+        }
+        if (n == 0) {
+            errno = EIO;   /* file shorter than the cached length */
+            return -1;
+        }
+        *offset += n;
+    }
+    return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef __ZCOPY_H__
+#define __ZCOPY_H__
+
+#define ZC_CHUNK 65536    /* bytes moved per splice() call, one pipe's worth */
+
+/*
+ * zc_splice - Move n bytes (everything up to EOF if n < 0) from socket
+ *     from to socket to through pipefd, without copying them through user
+ *     space. *moved counts the bytes delivered to to. Returns 0 on
+ *     success, 1 if a non-blocking descriptor would block (n is then only
+ *     partially moved; see *pending), or -1 with errno set on error. An
+ *     errno of EINVAL or ENOSYS with *moved == 0 means splice() does not
+ *     work for these descriptors and the caller should fall back to
+ *     read()/write().
+ *
+ *     *pending carries bytes already sitting in the pipe between calls; it
+ *     must start at 0 and the pipe must be discarded after an error.
+ */
+int zc_splice(int from, int to, int pipefd[2], long n, long *moved, long *pending);
+
+/*
+ * zc_sendfile - Send bytes [*offset, count) of file fd to socket to with
+ *     sendfile(), advancing *offset. Returns 0 once everything is sent, 1
+ *     if a non-blocking socket would block, or -1 with errno set.
+ */
+int zc_sendfile(int to, int fd, long *offset, long count);
+
+#endif /* __ZCOPY_H__ */